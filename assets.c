@@ -71,6 +71,12 @@ GFont* g_font_new (char *filename){
     return fnt;
 }
 
+void g_font_destroy( GFont *fnt ){
+    if( !fnt ) return;
+    glDeleteTextures( 1, &fnt->tex );
+    g_free( fnt );
+}
+
 void g_font_render ( GFont *fnt, char *str ){
     if(!fnt) return;
 
@@ -95,8 +101,8 @@ void g_font_render ( GFont *fnt, char *str ){
 //
 // Texture
 //
-int g_texture_load( GTexture *tex, const char* filename ){
-    unsigned char *pix, tmp, *src, *dst;
+int g_image_load( GImage *img, const char* filename ){
+    unsigned char *pix = NULL, tmp, *src, *dst;
     int pixsize, k, n, i,j;
 
     FILE* tga_file;
@@ -105,6 +111,7 @@ int g_texture_load( GTexture *tex, const char* filename ){
     char filepath[256];
     sprintf( filepath, "data/textures/%s", filename );
 
+    img->pixels = NULL;
     tga_file = fopen( filepath, "rb" );
     if( tga_file == NULL ) return 0;
 
@@ -186,25 +193,405 @@ int g_texture_load( GTexture *tex, const char* filename ){
 
     fclose(tga_file);
 
+    img->pixels = pix;
+    img->width = width;
+    img->height = height;
+    img->bpp = bytes_per_pixel;
+    return 1;
+
+error: fclose( tga_file );
+      if( pix ) g_free( pix );
+      return 0;
+}
+
+void g_image_free( GImage *img ){
+    if( img->pixels ) g_free( img->pixels );
+    img->pixels = NULL;
+}
+
+int g_texture_create( GTexture *tex, GImage *img ){
     GLuint texture;
     GLuint mode;
-    if( bytes_per_pixel == 1 ) mode = GL_ALPHA;
-    else mode = ( bytes_per_pixel == 3 ? GL_RGB : GL_RGBA );
+    tex->id = 0;
+    if( !img->pixels ) return 0;
+
+    if( img->bpp == 1 ) mode = GL_ALPHA;
+    else mode = ( img->bpp == 3 ? GL_RGB : GL_RGBA );
 
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, mode, width, height, 0, mode, GL_UNSIGNED_BYTE, pix);
+    glTexImage2D(GL_TEXTURE_2D, 0, mode, img->width, img->height, 0, mode, GL_UNSIGNED_BYTE, img->pixels);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
     tex->id = texture;
-    tex->width = width;
-    tex->height = height;
-    tex->bpp = bytes_per_pixel;
+    tex->width = img->width;
+    tex->height = img->height;
+    tex->bpp = img->bpp;
     return texture;
+}
 
-error: fclose( tga_file );
-      tex->id = 0;
-      return 0;
+int g_texture_load( GTexture *tex, const char* filename ){
+    GImage img;
+    tex->id = 0;
+    if( !g_image_load( &img, filename ) ) return 0;
+    g_texture_create( tex, &img );
+    g_image_free( &img );
+    return tex->id;
+}
+
+//
+// Shader
+//
+static GLuint compile_shader( GLenum type, const char *src ) {
+    GLint ok;
+    GLuint sh = glCreateShader( type );
+    glShaderSource( sh, 1, &src, NULL );
+    glCompileShader( sh );
+    glGetShaderiv( sh, GL_COMPILE_STATUS, &ok );
+    if( !ok ) {
+        char log[1024];
+        glGetShaderInfoLog( sh, sizeof(log), NULL, log );
+        g_debug_str( "shader compile error: %s\n", log );
+        glDeleteShader( sh );
+        return 0;
+    }
+    return sh;
+}
+
+GLuint g_program_new( const char *vs, const char *fs, const char **attribs, int num_attribs ){
+    if( !glCreateShader || !glCreateProgram ) return 0;
+
+    GLuint vsh = compile_shader( GL_VERTEX_SHADER, vs );
+    GLuint fsh = compile_shader( GL_FRAGMENT_SHADER, fs );
+    if( !vsh || !fsh ) {
+        if( vsh ) glDeleteShader( vsh );
+        if( fsh ) glDeleteShader( fsh );
+        return 0;
+    }
+
+    GLuint prog = glCreateProgram();
+    glAttachShader( prog, vsh );
+    glAttachShader( prog, fsh );
+
+    int i;
+    for( i = 0; i < num_attribs; i++ )
+        if( attribs[i] ) glBindAttribLocation( prog, i, attribs[i] );
+
+    GLint ok;
+    glLinkProgram( prog );
+    glDeleteShader( vsh ); // flagged for deletion, freed along with the program
+    glDeleteShader( fsh );
+    glGetProgramiv( prog, GL_LINK_STATUS, &ok );
+    if( !ok ) {
+        char log[1024];
+        glGetProgramInfoLog( prog, sizeof(log), NULL, log );
+        g_debug_str( "program link error: %s\n", log );
+        glDeleteProgram( prog );
+        return 0;
+    }
+    return prog;
+}
+
+//
+// Asynchronous loading
+//
+struct _GLoad {
+    const GLoadType *type;
+    void *job;
+    GJob *work;     // NULL once the worker part is done
+    int ok, uploaded, cancelled, state;
+    void *asset;
+    GLoadFunc done;
+    void *data;
+    GLoad *next;
+};
+
+struct _GLoader {
+    GWorkers *workers;
+    GLoad *pending; // in the order they were started, uploads go the same way
+};
+
+static void load_task( void *data, int first, int last ) {
+    GLoad *load = (GLoad*) data;
+    load->ok = load->type->work( load->job );
+}
+
+GLoader* g_loader_new( GWorkers* workers ){
+    GLoader* loader = g_new0( GLoader, 1 );
+    loader->workers = workers;
+    return loader;
+}
+
+GLoad* g_loader_add( GLoader* loader, const GLoadType* type, void *job, GLoadFunc done, void *data ){
+    GLoad* load = g_new0( GLoad, 1 );
+    load->type = type;
+    load->job = job;
+    load->done = done;
+    load->data = data;
+    load->state = G_LOAD_PENDING;
+
+    GLoad **end = &loader->pending;
+    while( *end ) end = &(*end)->next;
+    *end = load;
+
+    load->work = g_workers_submit( loader->workers, load_task, load );
+    return load;
+}
+
+// Uploads run one step at a time while the budget lasts, the first one always gets
+// a step so a budget shorter than any step still makes progress
+int g_loader_update( GLoader* loader, float budget_ms ){
+    double start = g_time();
+    int pending = 0, steps = 0;
+    GLoad **p = &loader->pending;
+
+    while( *p ) {
+        GLoad *load = *p;
+        if( load->work && g_workers_poll( loader->workers, load->work, 0 ) ) load->work = NULL;
+
+        if( !load->work && load->ok && !load->cancelled )
+            while( !load->uploaded && (!steps || (g_time() - start) * 1000 < budget_ms) ) {
+                load->uploaded = load->type->upload( load->job );
+                steps++;
+            }
+
+        if( load->work || (load->ok && !load->cancelled && !load->uploaded) ) {
+            pending++;
+            p = &load->next;
+            continue;
+        }
+
+        *p = load->next;
+        load->next = NULL;
+        load->asset = load->type->finish( load->job, load->ok && !load->cancelled );
+        load->state = load->asset ? G_LOAD_READY : G_LOAD_FAILED;
+        if( load->cancelled ) g_free( load );
+        else if( load->done ) load->done( load, load->data );
+    }
+    return pending;
+}
+
+void g_loader_destroy( GLoader* loader ){
+    if( !loader ) return;
+    while( loader->pending ) {
+        GLoad *load = loader->pending;
+        loader->pending = load->next;
+        if( load->work ) g_workers_poll( loader->workers, load->work, 1 );
+        load->type->finish( load->job, 0 );
+        // the caller still holds the handles it hasn't freed, they just fail
+        if( load->cancelled ) g_free( load );
+        else load->state = G_LOAD_FAILED;
+    }
+    g_free( loader );
+}
+
+int g_load_state( GLoad* load ){
+    return load->state;
+}
+
+void* g_load_asset( GLoad* load ){
+    return load->asset;
+}
+
+void g_load_free( GLoad* load ){
+    if( load->state == G_LOAD_PENDING ) load->cancelled = 1; // freed by the loader when it's done
+    else g_free( load );
+}
+
+// textures decode on the workers and upload in a single step
+typedef struct {
+    char filename[256];
+    GImage img;
+    GTexture *tex;
+} TextureLoad;
+
+static int texture_load_work( void *job ){
+    TextureLoad *t = (TextureLoad*) job;
+    return g_image_load( &t->img, t->filename );
+}
+
+static int texture_load_upload( void *job ){
+    TextureLoad *t = (TextureLoad*) job;
+    g_texture_create( t->tex, &t->img );
+    return 1;
+}
+
+static void* texture_load_finish( void *job, int ok ){
+    TextureLoad *t = (TextureLoad*) job;
+    GTexture *tex = ok && t->tex->id ? t->tex : NULL;
+    if( !tex ) g_free( t->tex );
+    g_image_free( &t->img );
+    g_free( t );
+    return tex;
+}
+
+static const GLoadType texture_load = { texture_load_work, texture_load_upload, texture_load_finish };
+
+GLoad* g_texture_load_async( GLoader* loader, const char *filename, GLoadFunc done, void *data ){
+    TextureLoad *t = g_new0( TextureLoad, 1 );
+    snprintf( t->filename, sizeof(t->filename), "%s", filename );
+    t->tex = g_new0( GTexture, 1 );
+    return g_loader_add( loader, &texture_load, t, done, data );
+}
+
+//
+// Asset cache
+//
+#define ASSET_BUCKETS 256
+
+enum { ASSET_TEXTURE, ASSET_FONT, ASSET_MODEL };
+
+typedef struct _AssetEntry {
+    int kind, flags, refs;
+    void *asset;
+    size_t bytes;                              // texture memory
+    struct _AssetEntry *next_name, *next_ptr;  // chains of the two lookups
+    char name[1];
+} AssetEntry;
+
+struct _GAssets {
+    AssetEntry *by_name[ASSET_BUCKETS], *by_ptr[ASSET_BUCKETS];
+    GAssetStats stats;
+};
+
+static unsigned int name_bucket( int kind, int flags, const char *name ){
+    unsigned int h = 2166136261u ^ (kind * 31 + flags); // FNV-1a
+    while( *name ) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h % ASSET_BUCKETS;
+}
+
+static unsigned int ptr_bucket( const void *p ){
+    return (unsigned int) (((size_t) p >> 4) % ASSET_BUCKETS);
+}
+
+GAssets* g_assets_new( void ){
+    return g_new0( GAssets, 1 );
+}
+
+// a reference to the cached asset, counted as a hit
+static void* assets_find( GAssets* a, int kind, int flags, const char *name ){
+    AssetEntry *e;
+    for( e = a->by_name[name_bucket( kind, flags, name )]; e; e = e->next_name )
+        if( e->kind == kind && e->flags == flags && !strcmp( e->name, name ) ) {
+            e->refs++;
+            a->stats.hits++;
+            return e->asset;
+        }
+    a->stats.misses++;
+    return NULL;
+}
+
+static void assets_add( GAssets* a, int kind, int flags, const char *name, void *asset, size_t bytes ){
+    AssetEntry *e = (AssetEntry*) malloc( sizeof(AssetEntry) + strlen( name ) );
+    e->kind = kind;
+    e->flags = flags;
+    e->refs = 1;
+    e->asset = asset;
+    e->bytes = bytes;
+    strcpy( e->name, name );
+
+    unsigned int b = name_bucket( kind, flags, name );
+    e->next_name = a->by_name[b];
+    a->by_name[b] = e;
+    b = ptr_bucket( asset );
+    e->next_ptr = a->by_ptr[b];
+    a->by_ptr[b] = e;
+
+    if( kind == ASSET_TEXTURE ) a->stats.textures++;
+    else if( kind == ASSET_FONT ) a->stats.fonts++;
+    else a->stats.models++;
+    a->stats.texture_bytes += bytes;
+}
+
+// unlinked before it is destroyed, a model releases its textures to the cache meanwhile
+static void assets_free( GAssets* a, AssetEntry *e ){
+    AssetEntry **p;
+    for( p = &a->by_name[name_bucket( e->kind, e->flags, e->name )]; *p != e; p = &(*p)->next_name );
+    *p = e->next_name;
+    for( p = &a->by_ptr[ptr_bucket( e->asset )]; *p != e; p = &(*p)->next_ptr );
+    *p = e->next_ptr;
+
+    a->stats.texture_bytes -= e->bytes;
+    if( e->kind == ASSET_TEXTURE ) {
+        GTexture *tex = (GTexture*) e->asset;
+        glDeleteTextures( 1, &tex->id );
+        g_free( tex );
+        a->stats.textures--;
+    } else if( e->kind == ASSET_FONT ) {
+        g_font_destroy( (GFont*) e->asset );
+        a->stats.fonts--;
+    } else {
+        g_model_destroy( (GModel*) e->asset );
+        a->stats.models--;
+    }
+    g_free( e );
+}
+
+GTexture* g_assets_texture( GAssets* a, const char *filename ){
+    GTexture *tex = (GTexture*) assets_find( a, ASSET_TEXTURE, 0, filename );
+    if( tex ) return tex;
+
+    tex = g_new0( GTexture, 1 );
+    if( !g_texture_load( tex, filename ) ) {
+        g_free( tex );
+        return NULL;
+    }
+    assets_add( a, ASSET_TEXTURE, 0, filename, tex, (size_t) tex->width * tex->height * tex->bpp );
+    return tex;
+}
+
+GFont* g_assets_font( GAssets* a, const char *filename ){
+    GFont *fnt = (GFont*) assets_find( a, ASSET_FONT, 0, filename );
+    if( fnt ) return fnt;
+
+    fnt = g_font_new( (char*) filename );
+    if( fnt ) assets_add( a, ASSET_FONT, 0, filename, fnt, 0 );
+    return fnt;
+}
+
+GModel* g_assets_model( GAssets* a, const char *filename, int flags ){
+    GModel *mdl = (GModel*) assets_find( a, ASSET_MODEL, flags, filename );
+    if( mdl ) return mdl;
+
+    mdl = g_model_load_shared( a, filename, flags );
+    if( mdl ) assets_add( a, ASSET_MODEL, flags, filename, mdl, 0 );
+    return mdl;
+}
+
+void g_assets_release( GAssets* a, void *asset ){
+    AssetEntry *e;
+    if( !asset ) return;
+    for( e = a->by_ptr[ptr_bucket( asset )]; e && e->asset != asset; e = e->next_ptr );
+    if( !e ) {
+        g_debug_str( "g_assets_release: %p isn't in the cache\n", asset );
+        return;
+    }
+    if( !--e->refs ) assets_free( a, e );
+}
+
+void g_assets_stats( GAssets* a, GAssetStats* stats ){
+    *stats = a->stats;
+}
+
+static AssetEntry* assets_first( GAssets* a, int models ){
+    int i;
+    AssetEntry *e;
+    for( i = 0; i < ASSET_BUCKETS; i++ )
+        for( e = a->by_name[i]; e; e = e->next_name )
+            if( !models || e->kind == ASSET_MODEL ) return e;
+    return NULL;
+}
+
+void g_assets_destroy( GAssets* a ){
+    AssetEntry *e;
+    if( !a ) return;
+    int models;
+    for( models = 1; models >= 0; models-- ) // models first, they hold textures
+        while( (e = assets_first( a, models )) ) {
+            g_debug_str( "g_assets_destroy: %s still has %d references\n", e->name, e->refs );
+            assets_free( a, e );
+        }
+    g_free( a );
 }
@@ -11,8 +11,16 @@
 GLE( GenBuffers, GENBUFFERS )
 GLE( BindBuffer, BINDBUFFER )
 GLE( BufferData, BUFFERDATA )
+GLE( DeleteBuffers, DELETEBUFFERS )
+GLE( MapBufferRange, MAPBUFFERRANGE )
+GLE( UnmapBuffer, UNMAPBUFFER )
+GLE( BufferStorage, BUFFERSTORAGE )
+GLE( FenceSync, FENCESYNC )
+GLE( ClientWaitSync, CLIENTWAITSYNC )
+GLE( DeleteSync, DELETESYNC )
 GLE( VertexAttribPointer, VERTEXATTRIBPOINTER )
 GLE( EnableVertexAttribArray, ENABLEVERTEXATTRIBARRAY )
+GLE( DisableVertexAttribArray, DISABLEVERTEXATTRIBARRAY )
 GLE( GenVertexArrays, GENVERTEXARRAYS )
 GLE( BindVertexArray, BINDVERTEXARRAY )
 GLE( CreateShader, CREATESHADER )
@@ -32,6 +40,13 @@ GLE( DeleteProgram, DELETEPROGRAM )
 GLE( GetUniformLocation, GETUNIFORMLOCATION )
 GLE( UniformMatrix4fv, UNIFORMMATRIX4FV )
 GLE( Uniform1i, UNIFORM1I )
+GLE( Uniform1f, UNIFORM1F )
+GLE( Uniform4fv, UNIFORM4FV )
+GLE( DrawElementsInstanced, DRAWELEMENTSINSTANCED )
+GLE( VertexAttribDivisor, VERTEXATTRIBDIVISOR )
+#ifdef _WIN32
+GLE( ActiveTexture, ACTIVETEXTURE ) // 1.3, exported by libGL elsewhere
+#endif
 
 //GLE(  )
 
@@ -374,3 +374,55 @@ void g_dual_quat_normalize( GDualQuat *dq ) {
         *dq = (GDualQuat){{.0, .0, .0, 1.0}, {.0, .0, .0, .0}};
     }
 }
+
+// Packing
+unsigned short g_float_to_half( float f ) {
+    union { float f; unsigned int u; } v;
+    v.f = f;
+    unsigned int sign = (v.u >> 16) & 0x8000;
+    unsigned int mant = v.u & 0x7fffff;
+    int exp = (int) ((v.u >> 23) & 0xff) - 127 + 15;
+
+    if( ((v.u >> 23) & 0xff) == 0xff ) return sign | 0x7c00 | (mant ? 0x200 : 0); // inf, nan
+    if( exp >= 31 ) return sign | 0x7c00; // too big, inf
+    if( exp <= 0 ) { // denormal or zero
+        if( exp < -10 ) return sign;
+        mant |= 0x800000;
+        unsigned int shift = 14 - exp;
+        unsigned int h = mant >> shift;
+        if( (mant >> (shift - 1)) & 1 ) h++;
+        return sign | h;
+    }
+
+    unsigned int h = sign | (exp << 10) | (mant >> 13);
+    if( mant & 0x1000 ) h++; // round to nearest, a carry correctly bumps the exponent
+    return h;
+}
+
+float g_half_to_float( unsigned short h ) {
+    union { float f; unsigned int u; } v;
+    unsigned int sign = (h & 0x8000) << 16;
+    unsigned int exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+
+    if( exp == 0 ) { // denormal or zero
+        v.f = mant / 16777216.0f;
+        v.u |= sign;
+    } else if( exp == 31 ) {
+        v.u = sign | 0x7f800000 | (mant << 13);
+    } else {
+        v.u = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    return v.f;
+}
+
+static int pack_snorm( float f, int bits ) {
+    int max = (1 << (bits - 1)) - 1;
+    if( f > 1.0f ) f = 1.0f;
+    if( f < -1.0f ) f = -1.0f;
+    return (int) floorf( f * max + 0.5f ) & ((1 << bits) - 1);
+}
+
+unsigned int g_pack_snorm10( GVec4 *v ) {
+    return (unsigned int) pack_snorm( v->x, 10 ) | (unsigned int) pack_snorm( v->y, 10 ) << 10 |
+           (unsigned int) pack_snorm( v->z, 10 ) << 20 | (unsigned int) pack_snorm( v->w, 2 ) << 30;
+}
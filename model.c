@@ -1,6 +1,20 @@
 #include "myr.h"
+#include <stddef.h>
+#include <float.h>
 
 #define EPSILON 0.002f
+#define SKIN_CHUNK 1024 // verts per worker task, multiple of 4 to keep the SIMD blocks whole
+#define SKIN_EPSILON 1e-5f // G_SKIN_INCREMENTAL reskins the verts of joints whose palette entry moved more than this
+#define POSE_CHUNK 16 // groups of 4 instances per worker task in g_model_pose_instances()
+#define STREAM_REGIONS 3 // frames in flight for the persistently mapped stream buffer
+#define VCACHE_SIZE 32 // post-transform cache modelled by the GM_OPTIMIZE triangle order and its ACMR report
+#define MAX_LODS 4 // levels including the full mesh, each one aims for half the triangles of the previous
+#define LOD_SCREEN_SIZE 0.5f // projected radius, in units of half the viewport height, under which LODs kick in
+#define BVH_BINS 16 // SAH split candidates per axis in GM_COLLISION builds
+#define BVH_LEAF_TRIS 8 // largest leaf the SAH may keep instead of splitting, in blocks of 4 for the SIMD test
+#define BVH_MAX_DEPTH 64 // ray cast stack, the build halves nodes past BVH_MAX_DEPTH/2 to stay under it
+#define INSTANCE_BATCH 256 // instances per glDrawElementsInstanced(), rows of the palette texture
+#define MAX_GPU_JOINTS 64 // 128 vec4 uniforms, the minimum a GL 2.x vertex shader provides is 512 components
 #define IQM_MAGIC "INTERQUAKEMODEL"
 #define IQM_VERSION 2
 
@@ -85,314 +99,3224 @@ typedef struct {
   float xyradius, radius;
 } IqmBounds;
 
-typedef struct{
-  GVec loc, normal;
-  GVec2 texcoord;
-  GVec4 tangent, bitangent;
+// Vertex data is split by access pattern: skinning reads the hot stream every
+// frame, the cold attributes are only read to build the vertex buffers
+typedef struct {
+  GVec loc;
   unsigned char blendindex[4], blendweight[4];
 } IqmVertex;
 
+typedef struct {
+  GVec normal;
+  GVec2 texcoord;
+  GVec4 tangent;
+} IqmVertexAttribs;
+
+typedef struct {
+  float x[4], y[4], z[4];
+  float weight[4][4];          // [influence][lane]
+  unsigned char index[4][4];
+} IqmSkinBlock;
+
+// GM_PACKED_VERTS layout of the static vertex buffer, 20 bytes instead of 48 for the same attributes
+typedef struct {
+  short pos[4];                 // mesh relative, pos * scale + bias, the 4th is padding
+  unsigned short texcoord[2];   // half floats
+  unsigned int normal, tangent; // 10:10:10:2 snorm, tangent w is the bitangent sign
+} PackedVertex;
+
+typedef struct {
+  GVec scale, bias;
+} MeshQuant;
+
+// GM_COMPRESS_ANIMS dequantization of a pose, channels are translate xyz, rotate xyzw and padding.
+// Channels missing from the file have a 0 scale, so every joint decodes the same 8 values
+typedef struct {
+  float offset[8], scale[8];
+} AnimChannels;
+
+// Ring for the per-frame skinned positions. With GL_ARB_buffer_storage it is
+// persistently mapped and split in STREAM_REGIONS regions guarded by fences,
+// otherwise the buffer is orphaned and mapped again for every write
+typedef struct {
+  GLuint vbo;
+  int size, region; // bytes per region, region being written
+  unsigned char *mapped;
+  GLsync fence[STREAM_REGIONS];
+} StreamBuffer;
+
+// A cached pose, its instance holds the palette and skins and draws for all those sharing it
+typedef struct {
+  GModelInstance *inst;
+  int clip, time;      // time in pose_step units, clip -1 while empty
+  unsigned int serial; // changes with the key
+} PoseSlot;
+
+// GM_COLLISION bounding volume hierarchy, depth first so the first child follows its parent
+typedef struct {
+  float min[3], max[3];
+  int first; // leaves: first TriBlock, inner nodes: the second child
+  int count; // TriBlocks of a leaf, 0 for inner nodes
+} BvhNode;
+
+// 4 triangles of a leaf in SoA form, as vertex 0 and the edges to 1 and 2
+typedef struct {
+  float v0[3][4], e1[3][4], e2[3][4];
+  int tri[4]; // -1 for padding, with zero edges so it never hits
+} TriBlock;
+
+// Per playback state, the rest of the model is shared by all its instances
+struct _GModelInstance {
+  GModel *mdl;
+  GDualQuat *outframe; // joint palette of the current pose
+  GVec *out_verts;     // skinned positions when they can't be streamed to the GPU
+  StreamBuffer stream;
+  GLintptr stream_ofs;
+  int streamed;        // the last skinned positions went to the stream
+  int skin_valid;      // they match outframe, posing clears it
+  float last_frame;    // of g_model_instance_draw(), NAN after any other posing
+  GDualQuat *skinned_frame; // G_SKIN_INCREMENTAL, the palette out_verts were skinned with
+  int frame1, frame2;  // file frames the pose lerps for G_SKIN_BAKED, frame1 -1 when it blends anything else
+  float frame_t;
+  int pose_slot;       // pose cache slot the pose came from, -1 if none
+  unsigned int pose_serial; // of the slot then, it is drawn instead while they match
+  GVec position;       // for g_anim_lod_update()
+  int lod;
+  int culled, lod_phase;
+  unsigned int lod_frame; // last g_anim_lod_update() that posed it, 0 if none did
+  GModelInstance *next_free;
+};
+
 struct _GModel {
   int num_meshes, num_verts, num_tris, num_joints, num_frames, num_anims;
-  char *str;
+  unsigned char *map; // the iqm file, meshes, tris, joints, poses and anims point into it
+  size_t map_size;
+  const char *text;   // names, in the mapping too
+  int num_text;
 
   IqmMesh *meshes;
-  IqmVertex *verts, *out_verts;
+  IqmVertex *verts;
+  IqmVertexAttribs *attribs;
   IqmTriangle *tris, *adjacency;
   GLuint *textures;
+  GAssets *assets;   // the materials come from it when loaded with g_model_load_shared()
+  GTexture **shared; // and are released to it with the model
   IqmJoint *joints;
   IqmPose *poses;
   IqmAnim *anims;
-  IqmBounds *bounds;
-
-    GDualQuat *base, *inversebase, *outframe, *frames; //in iqm demo its a 3x4 matrix
+  IqmBounds *bounds; // one per frame, in the mapping, NULL if the file has none
+
+  IqmSkinBlock *skin_blocks; // SoA copy of the skinning input for the SIMD path
+  int *joint_blocks, *joint_block_ofs; // G_SKIN_INCREMENTAL, the 4 vert blocks each joint moves
+  int *dirty_blocks;                   // scratch for the blocks to reskin
+  unsigned char *block_dirty;
+  int num_blocks;
+  GWorkers *workers;
+
+  int skinning;
+  PoseSlot *pose_cache;
+  int pose_slots;
+  float pose_step;
+  unsigned int pose_serial;
+  GPoseCacheStats pose_stats;
+  GLuint blend_vbo; // blend indexes and weights for G_SKIN_GPU
+  short *baked_verts; // G_SKIN_BAKED positions, 4 shorts per vert for every frame, NULL once in baked_vbo
+  GLuint baked_vbo;
+  MeshQuant baked_quant;
+  StreamBuffer instance_stream; // g_model_draw_instanced() transforms and palette rows
+  GLuint palette_tex;           // and palettes, one instance per row
+  GDualQuat *palette_data;
+  GLuint vbo, ibo;  // bind pose positions followed by texcoords (or PackedVertex), triangles
+  int flags, packed;
+  int optimized;      // meshes and tris are owned copies instead of pointing into the mapping
+  BvhNode *bvh_nodes;   // GM_COLLISION, over the file's triangles in the bind pose
+  TriBlock *bvh_blocks;
+  int num_bvh_nodes, num_bvh_blocks;
+  IqmTriangle *lod_tris; // GM_BUILD_LODS triangles, numbered after the file's in lod_ranges
+  int num_lod_tris, num_lods;
+  int *lod_ranges;    // first triangle and count for each level and mesh
+  GLenum index_type;  // of the ibo, 16 bit after GM_OPTIMIZE when the verts allow it
+  int index_size;
+  MeshQuant *quant; // per mesh position dequantization when packed
+
+  GModelInstance *instance;       // used by g_model_draw()
+  GModelInstance *free_instances; // destroyed instances kept for reuse
+  int num_instances;              // live ones, including 'instance'
+  int instance_serial;
+
+  GBounds bind_bounds;
+
+  unsigned short *anim_data; // GM_COMPRESS_ANIMS frames, 8 channels per joint instead of a GDualQuat
+  AnimChannels *channels;
+
+    GDualQuat *base, *inversebase, *frames; //in iqm demo its a 3x4 matrix
   };
 
+// one skinning pass, shared by the worker tasks
+typedef struct {
+  GModel *mdl;
+  GDualQuat *palette;
+  GVec *out;
+} SkinJob;
 
-  static int loadiqmmeshes( GModel *mdl, const char *filename, const iqmheader *hdr, unsigned char *buf ) {
-    mdl->num_meshes = hdr->num_meshes;
-    mdl->num_tris = hdr->num_triangles;
-    mdl->num_verts = hdr->num_vertexes;
-    mdl->num_joints = hdr->num_joints;
 
-    mdl->meshes = g_new( IqmMesh, mdl->num_meshes );
-    mdl->tris = g_new( IqmTriangle, mdl->num_tris );
-    mdl->verts = g_new( IqmVertex, mdl->num_verts );
-    mdl->joints = g_new( IqmJoint, mdl->num_joints );
-    mdl->textures = g_new0( GLuint, mdl->num_meshes );
+//
+// Vertex skinning
+//
+static void skin_vert( SkinJob *job, int i ) {
+  IqmVertex* v = &job->mdl->verts[i];
+  int j;
+  // weighted blend of bone transformations assigned to this vert ( here for fixed pipeline )
+  GDualQuat r = {{.0, .0, .0, .0}, {.0, .0, .0, .0}};
+  g_dual_quat_scale_add( &r, &job->palette[v->blendindex[0]], (v->blendweight[0]/255.0f) );
+  for( j = 1; j < 4 && v->blendweight[j]; j++ )
+    g_dual_quat_scale_add( &r, &job->palette[v->blendindex[j]], (v->blendweight[j]/255.0f) );
+
+  g_dual_quat_normalize( &r );
+
+  // Transform attributes by the blended dual quaternion.
+  g_dual_quat_vec_mul( &job->out[i], &r, &v->loc );
+
+//  *dstnorm = matnorm.transform(*srcnorm);
+  // Note that input tangent data has 4 coordinates,
+  // so only transform the first 3 as the tangent vector.
+//  *dsttan = matnorm.transform(Vec3(*srctan));
+  // Note that bitangent = cross(normal, tangent) * sign,
+  // where the sign is stored in the 4th coordinate of the input tangent data.
+//  *dstbitan = dstnorm->cross(*dsttan) * srctan->w;
+}
+
+#ifdef G_SSE
+// Structure of arrays copy of the skinning input, 4 verts per block.
+// Weights are pre-divided by 255 and zeroed after the first empty slot, so the blend
+// below gives the same result as the branchy scalar loop in skin_vert()
+static void build_skin_blocks( GModel *mdl ) {
+  int i, j, k;
+  mdl->num_blocks = (mdl->num_verts + 3) / 4;
+  mdl->skin_blocks = (IqmSkinBlock*) _mm_malloc( sizeof(IqmSkinBlock) * mdl->num_blocks, 16 );
+  memset( mdl->skin_blocks, 0, sizeof(IqmSkinBlock) * mdl->num_blocks );
+
+  for( i = 0; i < mdl->num_verts; i++ ) {
+    IqmVertex *v = &mdl->verts[i];
+    IqmSkinBlock *b = &mdl->skin_blocks[i/4];
+    int lane = i & 3;
+
+    b->x[lane] = v->loc.x;
+    b->y[lane] = v->loc.y;
+    b->z[lane] = v->loc.z;
+    for( j = 0, k = 1; j < 4; j++ ) {
+      if( j > 0 && !v->blendweight[j] ) k = 0;
+      b->index[j][lane] = v->blendindex[j];
+      b->weight[j][lane] = k ? v->blendweight[j]/255.0f : 0.0f;
+    }
+  }
+}
+
+#define SSE_CROSS( rx, ry, rz, ax, ay, az, bx, by, bz ) \
+  rx = _mm_sub_ps( _mm_mul_ps(ay, bz), _mm_mul_ps(az, by) ); \
+  ry = _mm_sub_ps( _mm_mul_ps(az, bx), _mm_mul_ps(ax, bz) ); \
+  rz = _mm_sub_ps( _mm_mul_ps(ax, by), _mm_mul_ps(ay, bx) );
+
+// Same math as skin_vert() but on 4 verts at once, one per SSE lane
+static void skin_block_sse( GDualQuat *palette, IqmSkinBlock *b, float *out ) {
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 sign = _mm_set1_ps( -0.0f );
+  __m128 qx = zero, qy = zero, qz = zero, qw = zero;
+  __m128 dx = zero, dy = zero, dz = zero, dw = zero;
+  int k;
+
+  for( k = 0; k < 4; k++ ) {
+    __m128 w = _mm_load_ps( b->weight[k] );
+    if( k > 0 && !_mm_movemask_ps(_mm_cmpneq_ps(w, zero)) ) break;
+
+    const float *p0 = (float*) &palette[b->index[k][0]], *p1 = (float*) &palette[b->index[k][1]],
+                *p2 = (float*) &palette[b->index[k][2]], *p3 = (float*) &palette[b->index[k][3]];
+    __m128 ax = _mm_loadu_ps( p0 ), ay = _mm_loadu_ps( p1 ), az = _mm_loadu_ps( p2 ), aw = _mm_loadu_ps( p3 );
+    __m128 bx = _mm_loadu_ps( p0+4 ), by = _mm_loadu_ps( p1+4 ), bz = _mm_loadu_ps( p2+4 ), bw = _mm_loadu_ps( p3+4 );
+    _MM_TRANSPOSE4_PS( ax, ay, az, aw );
+    _MM_TRANSPOSE4_PS( bx, by, bz, bw );
+
+    // flip the weight where the joint lies in the opposite hemisphere (see g_dual_quat_scale_add)
+    __m128 dot = _mm_add_ps( _mm_add_ps(_mm_mul_ps(qx, ax), _mm_mul_ps(qy, ay)),
+                             _mm_add_ps(_mm_mul_ps(qz, az), _mm_mul_ps(qw, aw)) );
+    w = _mm_xor_ps( w, _mm_and_ps(_mm_cmplt_ps(dot, zero), sign) );
+
+    qx = _mm_add_ps( qx, _mm_mul_ps(ax, w) ); qy = _mm_add_ps( qy, _mm_mul_ps(ay, w) );
+    qz = _mm_add_ps( qz, _mm_mul_ps(az, w) ); qw = _mm_add_ps( qw, _mm_mul_ps(aw, w) );
+    dx = _mm_add_ps( dx, _mm_mul_ps(bx, w) ); dy = _mm_add_ps( dy, _mm_mul_ps(by, w) );
+    dz = _mm_add_ps( dz, _mm_mul_ps(bz, w) ); dw = _mm_add_ps( dw, _mm_mul_ps(bw, w) );
+  }
 
-    const char *str = hdr->ofs_text ? (char *)&buf[hdr->ofs_text] : "";
-    IqmVertexArray *vas = (IqmVertexArray *)&buf[hdr->ofs_vertexarrays];
-
-    float *loc=NULL, *normal=NULL, *texcoord=NULL, *tangent=NULL;
-    unsigned char *blendindex = NULL, *blendweight=NULL;
-
-    int i,j;
-    for( i = 0; i < (int)hdr->num_vertexarrays; i++ ) {
-      IqmVertexArray *va = &vas[i];
-      switch(va->type) {
-        case IQM_POSITION:
-        if(va->format != IQM_FLOAT || va->size != 3) return 0;
-        loc = (float *) &buf[va->offset];
-        break;
-
-        case IQM_NORMAL:
-        if(va->format != IQM_FLOAT || va->size != 3) return 0;
-        normal = (float *) &buf[va->offset];
-        break;
-
-        case IQM_TANGENT:
-        if(va->format != IQM_FLOAT || va->size != 4) return 0;
-        tangent = (float *) &buf[va->offset];
-        break;
-
-        case IQM_TEXCOORD:
-        if(va->format != IQM_FLOAT || va->size != 2) return 0;
-        texcoord = (float *) &buf[va->offset];
-        break;
-
-        case IQM_BLENDINDEXES:
-        if(va->format != IQM_UBYTE || va->size != 4) return 0;
-        blendindex = (unsigned char*) &buf[va->offset];
-        break;
-
-        case IQM_BLENDWEIGHTS:
-        if(va->format != IQM_UBYTE || va->size != 4) return 0;
-        blendweight = (unsigned char*) &buf[va->offset];
-        break;
+  // normalize, degenerate lanes fall back to the identity like g_dual_quat_normalize
+  __m128 len = _mm_sqrt_ps( _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)),
+                                       _mm_add_ps(_mm_mul_ps(qz, qz), _mm_mul_ps(qw, qw))) );
+  __m128 valid = _mm_cmpge_ps( len, _mm_set1_ps(0.00001f) );
+  __m128 inv = _mm_and_ps( _mm_div_ps(_mm_set1_ps(1.0f), len), valid );
+  qx = _mm_mul_ps( qx, inv ); qy = _mm_mul_ps( qy, inv ); qz = _mm_mul_ps( qz, inv );
+  qw = _mm_or_ps( _mm_mul_ps(qw, inv), _mm_andnot_ps(valid, _mm_set1_ps(1.0f)) );
+  dx = _mm_mul_ps( dx, inv ); dy = _mm_mul_ps( dy, inv ); dz = _mm_mul_ps( dz, inv ); dw = _mm_mul_ps( dw, inv );
+
+  // rotation: v + w*t + q x t, with t = 2 * (q x v)
+  __m128 vx = _mm_load_ps( b->x ), vy = _mm_load_ps( b->y ), vz = _mm_load_ps( b->z );
+  __m128 two = _mm_set1_ps( 2.0f );
+  __m128 tx, ty, tz, cx, cy, cz;
+  SSE_CROSS( tx, ty, tz, qx, qy, qz, vx, vy, vz );
+  tx = _mm_mul_ps( tx, two ); ty = _mm_mul_ps( ty, two ); tz = _mm_mul_ps( tz, two );
+  SSE_CROSS( cx, cy, cz, qx, qy, qz, tx, ty, tz );
+  vx = _mm_add_ps( vx, _mm_add_ps(_mm_mul_ps(qw, tx), cx) );
+  vy = _mm_add_ps( vy, _mm_add_ps(_mm_mul_ps(qw, ty), cy) );
+  vz = _mm_add_ps( vz, _mm_add_ps(_mm_mul_ps(qw, tz), cz) );
+
+  // translation: 2 * (w*d - dw*q + q x d)
+  SSE_CROSS( cx, cy, cz, qx, qy, qz, dx, dy, dz );
+  tx = _mm_add_ps( _mm_sub_ps(_mm_mul_ps(qw, dx), _mm_mul_ps(dw, qx)), cx );
+  ty = _mm_add_ps( _mm_sub_ps(_mm_mul_ps(qw, dy), _mm_mul_ps(dw, qy)), cy );
+  tz = _mm_add_ps( _mm_sub_ps(_mm_mul_ps(qw, dz), _mm_mul_ps(dw, qz)), cz );
+
+  _mm_storeu_ps( out,   _mm_add_ps(vx, _mm_mul_ps(tx, two)) );
+  _mm_storeu_ps( out+4, _mm_add_ps(vy, _mm_mul_ps(ty, two)) );
+  _mm_storeu_ps( out+8, _mm_add_ps(vz, _mm_mul_ps(tz, two)) );
+}
+
+#undef SSE_CROSS
+#endif
+
+// Skins the verts in [first, last), first must be a multiple of 4 for the SSE path
+static void skin_verts( SkinJob *job, int first, int last ) {
+  int i = first;
+#ifdef G_SSE
+  float out[12];
+  for( ; i + 4 <= last; i += 4 ) {
+    GVec *o = &job->out[i];
+    skin_block_sse( job->palette, &job->mdl->skin_blocks[i/4], out );
+    o[0].x = out[0]; o[0].y = out[4]; o[0].z = out[8];
+    o[1].x = out[1]; o[1].y = out[5]; o[1].z = out[9];
+    o[2].x = out[2]; o[2].y = out[6]; o[2].z = out[10];
+    o[3].x = out[3]; o[3].y = out[7]; o[3].z = out[11];
+  }
+#endif
+  for( ; i < last; i++ ) skin_vert( job, i );
+}
+
+static void skin_task( void *data, int first, int last ) {
+  skin_verts( (SkinJob*) data, first, last );
+}
+
+// With the file mapped, every array must be inside it and 4 byte aligned to be used in place
+static int iqm_in_file( const iqmheader *hdr, unsigned int ofs, unsigned int count, unsigned int size ) {
+  if( !count ) return 1;
+  return !(ofs & 3) && ofs <= hdr->filesize && count <= (hdr->filesize - ofs) / size;
+}
+
+//
+// Mesh optimization (GM_OPTIMIZE)
+//
+// average vertices transformed per triangle with a VCACHE_SIZE entry LRU cache
+static float acmr( const IqmTriangle *tris, int num_tris ) {
+  unsigned int cache[VCACHE_SIZE];
+  int i, k, c, n = 0, misses = 0;
+  for( i = 0; i < num_tris; i++ )
+    for( k = 0; k < 3; k++ ) {
+      unsigned int v = tris[i].vertex[k];
+      for( c = 0; c < n && cache[c] != v; c++ );
+      if( c == n ) { // miss, the last entry falls out when the cache is full
+        misses++;
+        if( n < VCACHE_SIZE ) n++;
+        c = n-1;
       }
+      memmove( &cache[1], &cache[0], c*sizeof(unsigned int) );
+      cache[0] = v;
+    }
+  return num_tris ? (float) misses / num_tris : 0;
+}
+
+// Tom Forsyth's score: recently used verts and verts with few triangles left go first
+static float vcache_score( int cache_pos, int active ) {
+  if( !active ) return -1;
+  float score = 0;
+  if( cache_pos >= 0 ) score = cache_pos < 3 ? 0.75f : powf( 1 - (cache_pos - 3) / (float) (VCACHE_SIZE - 3), 1.5f );
+  return score + 2.0f / sqrtf( (float) active );
+}
+
+// Greedy triangle order for the post-transform cache, the next triangle is the best
+// scoring one among those of the cached verts, or the next one left when there is none
+static void optimize_tri_order( IqmTriangle *tris, int num_tris, int num_verts ) {
+  int *active = g_new0( int, num_verts ), *offset = g_new( int, num_verts+1 ), *vtris = g_new( int, 3*num_tris );
+  int *cache_pos = g_new( int, num_verts );
+  float *vscore = g_new( float, num_verts ), *tscore = g_new( float, num_tris );
+  unsigned char *emitted = g_new0( unsigned char, num_tris );
+  IqmTriangle *out = g_new( IqmTriangle, num_tris );
+  int cache[VCACHE_SIZE+3], cache_n = 0;
+  int i, k, n, t, best = -1, next = 0;
+  float best_score = -1;
+
+  // triangles of every vertex
+  for( i = 0; i < num_tris; i++ )
+    for( k = 0; k < 3; k++ ) active[tris[i].vertex[k]]++;
+  for( i = 0, offset[0] = 0; i < num_verts; i++ ) offset[i+1] = offset[i] + active[i];
+  memset( cache_pos, 0, sizeof(int)*num_verts );
+  for( i = 0; i < num_tris; i++ )
+    for( k = 0; k < 3; k++ ) {
+      int v = tris[i].vertex[k];
+      vtris[offset[v] + cache_pos[v]++] = i;
     }
 
-    for( j=0; j<mdl->num_verts; j++ ){
-      IqmVertex *v = &mdl->verts[j];
-      if( loc ) memcpy( &v->loc, &loc[j*3], sizeof(GVec) );
-      if( normal ) memcpy( &v->normal, &normal[j*3], sizeof(GVec) );
-      if( tangent ) memcpy( &v->tangent, &tangent[j*4], sizeof(GVec4) );
-      if( texcoord ) memcpy( &v->texcoord, &texcoord[j*2], sizeof(GVec2) );
-      if( blendindex ) memcpy( &v->blendindex, &blendindex[j*4], sizeof(unsigned char)*4 );
-      if( blendweight ) memcpy( &v->blendweight, &blendweight[j*4], sizeof(unsigned char)*4 );
-    }
-
-    IqmTriangle * tris = (IqmTriangle *) &buf[hdr->ofs_triangles];
-    IqmMesh* meshes = (IqmMesh *) &buf[hdr->ofs_meshes];
-    IqmJoint* joints = (IqmJoint *) &buf[hdr->ofs_joints];
-    //    if( hdr->ofs_adjacency ) adjacency = ( IqmTriangle *) &buf[hdr->ofs_adjacency];
-
-    for( i=0; i<mdl->num_tris; i++ ) mdl->tris[i] = tris[i];
-      for( i=0; i<mdl->num_meshes; i++ ) mdl->meshes[i] = meshes[i];
-        for( i=0; i<mdl->num_joints; i++ ) mdl->joints[i] = joints[i];
-
-          mdl->base = g_new( GDualQuat, hdr->num_joints );
-        mdl->inversebase = g_new( GDualQuat, hdr->num_joints );
-        for( i = 0; i < (int) hdr->num_joints; i++ ) {
-          IqmJoint *j = &joints[i];
-          g_quat_normalize( &j->rotate );
-          g_dual_quat_from_quat_vec( &mdl->base[i], &j->rotate, &j->translate );
-
-          if( j->parent >= 0)
-            g_dual_quat_mul( &mdl->base[i], &mdl->base[j->parent], &mdl->base[i] );
-
-          g_dual_quat_invert( &mdl->inversebase[i], &mdl->base[i] );
-        }
+  for( i = 0; i < num_verts; i++ ) {
+    cache_pos[i] = -1;
+    vscore[i] = vcache_score( -1, active[i] );
+  }
+  for( i = 0; i < num_tris; i++ ) {
+    tscore[i] = vscore[tris[i].vertex[0]] + vscore[tris[i].vertex[1]] + vscore[tris[i].vertex[2]];
+    if( tscore[i] > best_score ) { best_score = tscore[i]; best = i; }
+  }
 
-        GTexture tex;
-        for( i = 0; i < (int)hdr->num_meshes; i++ ) {
-          IqmMesh *m = &mdl->meshes[i];
-          g_debug_str("%s: loaded mesh: %s\n", filename, &str[m->name]);
+  for( n = 0; n < num_tris; n++ ) {
+    if( best < 0 ) {
+      while( emitted[next] ) next++;
+      best = next;
+    }
+    emitted[best] = 1;
+    out[n] = tris[best];
+
+    // the triangle's verts move to the front of the cache
+    int new_cache[VCACHE_SIZE+3], new_n = 0;
+    for( k = 0; k < 3; k++ ) {
+      int v = tris[best].vertex[k], *list = &vtris[offset[v]];
+      for( i = 0; list[i] != best; i++ );
+      list[i] = list[--active[v]];
+      list[active[v]] = best;
+      if( k == 0 || (v != new_cache[0] && (new_n < 2 || v != new_cache[1])) ) new_cache[new_n++] = v;
+    }
+    for( i = 0; i < cache_n; i++ )
+      if( cache[i] != new_cache[0] && (new_n < 2 || cache[i] != new_cache[1]) && (new_n < 3 || cache[i] != new_cache[2]) )
+        new_cache[new_n++] = cache[i];
+
+    // rescore the verts that were or are in the cache, then their triangles
+    for( i = 0; i < new_n; i++ ) {
+      int v = new_cache[i];
+      cache_pos[v] = i < VCACHE_SIZE ? i : -1;
+      vscore[v] = vcache_score( cache_pos[v], active[v] );
+    }
+    best = -1;
+    best_score = -1;
+    for( i = 0; i < new_n && i < VCACHE_SIZE; i++ ) {
+      int v = new_cache[i];
+      for( k = 0; k < active[v]; k++ ) {
+        t = vtris[offset[v] + k];
+        tscore[t] = vscore[tris[t].vertex[0]] + vscore[tris[t].vertex[1]] + vscore[tris[t].vertex[2]];
+        if( tscore[t] > best_score ) { best_score = tscore[t]; best = t; }
+      }
+    }
+    cache_n = new_n < VCACHE_SIZE ? new_n : VCACHE_SIZE;
+    memcpy( cache, new_cache, sizeof(int)*cache_n );
+  }
 
-          mdl->textures[i] = g_texture_load( &tex, &str[m->material] );
-          if( mdl->textures[i] ) g_debug_str("%s: loaded material: %s\n", filename, &str[m->material]);
-          else g_debug_str("%s: couldn't load material: %s\n", filename, &str[m->material]);
+  memcpy( tris, out, sizeof(IqmTriangle)*num_tris );
+  g_free( active ); g_free( offset ); g_free( vtris ); g_free( cache_pos );
+  g_free( vscore ); g_free( tscore ); g_free( emitted ); g_free( out );
+}
+
+// FNV-1a, start with 2166136261
+static unsigned int fnv1a( unsigned int h, const void *data, size_t size ) {
+  const unsigned char *p = (const unsigned char*) data;
+  size_t i;
+  for( i = 0; i < size; i++ ) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+static unsigned int hash_vertex( const IqmVertex *v, const IqmVertexAttribs *a ) {
+  return fnv1a( fnv1a( 2166136261u, v, sizeof(IqmVertex) ), a, sizeof(IqmVertexAttribs) );
+}
+
+// Welds identical verts, reorders each mesh's triangles for the vertex cache, then
+// renumbers the verts in the order the triangles first use them, dropping unused ones
+static void optimize_meshes( GModel *mdl, const char *filename ) {
+  int i, k, num_verts = mdl->num_verts;
+  float before = acmr( mdl->tris, mdl->num_tris );
+
+  IqmMesh *meshes = g_new( IqmMesh, mdl->num_meshes );
+  IqmTriangle *tris = g_new( IqmTriangle, mdl->num_tris );
+  memcpy( meshes, mdl->meshes, sizeof(IqmMesh)*mdl->num_meshes );
+  memcpy( tris, mdl->tris, sizeof(IqmTriangle)*mdl->num_tris );
+  mdl->meshes = meshes;
+  mdl->tris = tris;
+  mdl->optimized = 1;
+
+  // weld through an open addressing table of vertex indexes
+  int size = 1, *table, *remap = g_new( int, num_verts );
+  while( size < 2*num_verts ) size <<= 1;
+  table = g_new( int, size );
+  memset( table, -1, sizeof(int)*size );
+  for( i = 0; i < num_verts; i++ ) {
+    unsigned int h = hash_vertex( &mdl->verts[i], &mdl->attribs[i] ) & (size-1);
+    for( ;; h = (h+1) & (size-1) ) {
+      int j = table[h];
+      if( j < 0 ) { table[h] = remap[i] = i; break; }
+      if( !memcmp( &mdl->verts[i], &mdl->verts[j], sizeof(IqmVertex) ) &&
+          !memcmp( &mdl->attribs[i], &mdl->attribs[j], sizeof(IqmVertexAttribs) ) ) { remap[i] = j; break; }
+    }
+  }
+  for( i = 0; i < mdl->num_tris; i++ )
+    for( k = 0; k < 3; k++ ) tris[i].vertex[k] = remap[tris[i].vertex[k]];
+  g_free( table );
+
+  for( i = 0; i < mdl->num_meshes; i++ )
+    optimize_tri_order( &tris[meshes[i].first_triangle], meshes[i].num_triangles, num_verts );
+
+  // vertex fetch order, meshes get the range of the verts they use
+  IqmVertex *verts = g_new( IqmVertex, num_verts );
+  IqmVertexAttribs *attribs = g_new( IqmVertexAttribs, num_verts );
+  int used = 0;
+  for( i = 0; i < num_verts; i++ ) remap[i] = -1;
+  for( i = 0; i < mdl->num_meshes; i++ ) {
+    IqmMesh *m = &meshes[i];
+    int t, lo = num_verts, hi = -1;
+    for( t = m->first_triangle; t < (int) (m->first_triangle + m->num_triangles); t++ )
+      for( k = 0; k < 3; k++ ) {
+        int v = tris[t].vertex[k];
+        if( remap[v] < 0 ) {
+          verts[used] = mdl->verts[v];
+          attribs[used] = mdl->attribs[v];
+          remap[v] = used++;
         }
+        tris[t].vertex[k] = remap[v];
+        if( remap[v] < lo ) lo = remap[v];
+        if( remap[v] > hi ) hi = remap[v];
+      }
+    m->first_vertex = hi < 0 ? 0 : lo;
+    m->num_vertexes = hi < 0 ? 0 : hi - lo + 1;
+  }
+  g_free( remap );
+  g_free( mdl->verts );
+  g_free( mdl->attribs );
+  mdl->verts = verts;
+  mdl->attribs = attribs;
+  mdl->num_verts = used;
+
+  g_debug_str( "%s: optimized %d -> %d verts, ACMR %.3f -> %.3f\n", filename, num_verts, used, before, acmr( tris, mdl->num_tris ) );
+}
+
+//
+// Mesh LODs (GM_BUILD_LODS)
+//
+// Quadric error simplification by half edge collapses, a vertex always collapses onto one of
+// its neighbours, so the LODs index the same verts and keep their skinning weights as they are.
+// Verts on open or non manifold edges (borders and attribute seams) are never removed
+typedef struct {
+  double a[10]; // symmetric 4x4: xx xy xz xw yy yz yw zz zw ww
+} Quadric;
 
-        return 1;
+typedef struct {
+  float cost;
+  int from, to;
+} Collapse;
+
+typedef struct {
+  unsigned int v[2]; // lower index first
+} Edge;
+
+static void quadric_add_plane( Quadric *q, double a, double b, double c, double d, double w ) {
+  q->a[0] += w*a*a; q->a[1] += w*a*b; q->a[2] += w*a*c; q->a[3] += w*a*d;
+  q->a[4] += w*b*b; q->a[5] += w*b*c; q->a[6] += w*b*d;
+  q->a[7] += w*c*c; q->a[8] += w*c*d;
+  q->a[9] += w*d*d;
+}
+
+static double quadric_error( const Quadric *q, const GVec *v ) {
+  double x = v->x, y = v->y, z = v->z;
+  double e = q->a[0]*x*x + 2*q->a[1]*x*y + 2*q->a[2]*x*z + 2*q->a[3]*x
+           + q->a[4]*y*y + 2*q->a[5]*y*z + 2*q->a[6]*y
+           + q->a[7]*z*z + 2*q->a[8]*z + q->a[9];
+  return fabs( e );
+}
+
+static void tri_normal( GModel *mdl, unsigned int a, unsigned int b, unsigned int c, GVec *n ) {
+  GVec e1, e2;
+  g_vec_sub( &e1, &mdl->verts[b].loc, &mdl->verts[a].loc );
+  g_vec_sub( &e2, &mdl->verts[c].loc, &mdl->verts[a].loc );
+  g_vec_cross( n, &e1, &e2 );
+}
+
+static int cmp_collapse( const void *a, const void *b ) {
+  float ca = ((const Collapse*) a)->cost, cb = ((const Collapse*) b)->cost;
+  return ca < cb ? -1 : ca > cb;
+}
+
+static int cmp_edge( const void *a, const void *b ) {
+  const unsigned int *ea = ((const Edge*) a)->v, *eb = ((const Edge*) b)->v;
+  if( ea[0] != eb[0] ) return ea[0] < eb[0] ? -1 : 1;
+  return ea[1] < eb[1] ? -1 : ea[1] > eb[1];
+}
+
+// Collapsing 'from' onto 'to' must not flip or fold over any of the triangles that keep their area,
+// returns how many triangles it removes or -1 if it can't be done
+static int collapse_check( GModel *mdl, IqmTriangle *tris, int *adj, int *offset, int from, int to ) {
+  int i, k, removed = 0;
+  for( i = offset[from]; i < offset[from+1]; i++ ) {
+    unsigned int *v = tris[adj[i]].vertex, w[3];
+    if( v[0] == (unsigned int) to || v[1] == (unsigned int) to || v[2] == (unsigned int) to ) {
+      removed++;
+      continue;
+    }
+    GVec n0, n1;
+    for( k = 0; k < 3; k++ ) w[k] = v[k] == (unsigned int) from ? (unsigned int) to : v[k];
+    tri_normal( mdl, v[0], v[1], v[2], &n0 );
+    tri_normal( mdl, w[0], w[1], w[2], &n1 );
+    if( g_vec_dot( &n0, &n1 ) <= 0.25f * g_vec_mag( &n0 ) * g_vec_mag( &n1 ) ) return -1; // flips or folds
+  }
+  return removed;
+}
+
+// Simplifies tris in place down to about 'target' triangles and returns how many are left.
+// Every pass collapses the cheapest edges whose verts weren't touched yet in that pass
+static int simplify( GModel *mdl, IqmTriangle *tris, int num_tris, int target, Quadric *q ) {
+  int n = mdl->num_verts, i, k;
+  int *offset = g_new( int, n+1 ), *adj = g_new( int, 3*num_tris ), *remap = g_new( int, n );
+  unsigned char *locked = g_new( unsigned char, n ), *touched = g_new( unsigned char, n );
+  Edge *edges = g_new( Edge, 3*num_tris );
+  Collapse *collapses = g_new( Collapse, 3*num_tris );
+
+  while( num_tris > target ) {
+    // triangles around every vertex
+    memset( offset, 0, sizeof(int)*(n+1) );
+    for( i = 0; i < num_tris; i++ )
+      for( k = 0; k < 3; k++ ) offset[tris[i].vertex[k]+1]++;
+    for( i = 0; i < n; i++ ) offset[i+1] += offset[i];
+    for( i = 0; i < n; i++ ) remap[i] = offset[i];
+    for( i = 0; i < num_tris; i++ )
+      for( k = 0; k < 3; k++ ) adj[remap[tris[i].vertex[k]]++] = i;
+
+    // edges used by anything but two triangles lock their verts
+    int num_edges = 0, num_collapses = 0;
+    for( i = 0; i < num_tris; i++ )
+      for( k = 0; k < 3; k++ ) {
+        unsigned int a = tris[i].vertex[k], b = tris[i].vertex[(k+1)%3];
+        edges[num_edges].v[0] = a < b ? a : b;
+        edges[num_edges++].v[1] = a < b ? b : a;
+      }
+    qsort( edges, num_edges, sizeof(Edge), cmp_edge );
+    memset( locked, 0, n );
+    for( i = 0; i < num_edges; ) {
+      for( k = i+1; k < num_edges && !cmp_edge( &edges[i], &edges[k] ); k++ );
+      if( k - i != 2 ) locked[edges[i].v[0]] = locked[edges[i].v[1]] = 1;
+      i = k;
+    }
+    for( i = 0; i < num_edges; i++ ) {
+      int a = edges[i].v[0], b = edges[i].v[1];
+      if( (i && !cmp_edge( &edges[i-1], &edges[i] )) || locked[a] || locked[b] ) continue;
+      Quadric sum = q[a];
+      for( k = 0; k < 10; k++ ) sum.a[k] += q[b].a[k];
+      double ab = quadric_error( &sum, &mdl->verts[b].loc ), ba = quadric_error( &sum, &mdl->verts[a].loc );
+      Collapse *c = &collapses[num_collapses++];
+      c->from = ab <= ba ? a : b;
+      c->to = ab <= ba ? b : a;
+      c->cost = (float) (ab <= ba ? ab : ba);
+    }
+    qsort( collapses, num_collapses, sizeof(Collapse), cmp_collapse );
+
+    int removed = 0, applied = 0;
+    memset( touched, 0, n );
+    for( i = 0; i < n; i++ ) remap[i] = i;
+    for( i = 0; i < num_collapses && num_tris - removed > target; i++ ) {
+      Collapse *c = &collapses[i];
+      if( touched[c->from] || touched[c->to] ) continue;
+      int r = collapse_check( mdl, tris, adj, offset, c->from, c->to );
+      if( r < 0 ) continue;
+
+      remap[c->from] = c->to;
+      for( k = 0; k < 10; k++ ) q[c->to].a[k] += q[c->from].a[k];
+      for( k = offset[c->from]; k < offset[c->from+1]; k++ ) {
+        unsigned int *v = tris[adj[k]].vertex;
+        touched[v[0]] = touched[v[1]] = touched[v[2]] = 1;
+      }
+      removed += r;
+      applied++;
+    }
+    if( !applied ) break;
+
+    // apply the pass, dropping the triangles that lost their area
+    int out = 0;
+    for( i = 0; i < num_tris; i++ ) {
+      IqmTriangle t;
+      for( k = 0; k < 3; k++ ) t.vertex[k] = remap[tris[i].vertex[k]];
+      if( t.vertex[0] != t.vertex[1] && t.vertex[1] != t.vertex[2] && t.vertex[0] != t.vertex[2] ) tris[out++] = t;
+    }
+    num_tris = out;
+  }
+
+  g_free( offset ); g_free( adj ); g_free( remap ); g_free( locked );
+  g_free( touched ); g_free( edges ); g_free( collapses );
+  return num_tris;
+}
+
+// Level 0 is the file's triangles, the others are simplified from the previous level of the
+// same mesh. A mesh that can't be reduced any further keeps using its last level
+static void build_lods( GModel *mdl, const char *filename ) {
+  int i, j, k, level;
+  mdl->num_lods = 1;
+  mdl->lod_ranges = g_new( int, 2*MAX_LODS*mdl->num_meshes );
+  for( i = 0; i < mdl->num_meshes; i++ ) {
+    mdl->lod_ranges[2*i] = mdl->meshes[i].first_triangle;
+    mdl->lod_ranges[2*i+1] = mdl->meshes[i].num_triangles;
+  }
+  if( !(mdl->flags & GM_BUILD_LODS) || !mdl->num_tris ) return;
+
+  Quadric *q = g_new( Quadric, mdl->num_verts );
+  IqmTriangle *work = g_new( IqmTriangle, mdl->num_tris );
+  mdl->lod_tris = g_new( IqmTriangle, mdl->num_tris * (MAX_LODS-1) ); // shrunk below
+
+  for( level = 1; level < MAX_LODS; level++ ) {
+    int reduced = 0;
+    for( i = 0; i < mdl->num_meshes; i++ ) {
+      int *prev = &mdl->lod_ranges[2*((level-1)*mdl->num_meshes + i)], *cur = prev + 2*mdl->num_meshes;
+      cur[0] = prev[0];
+      cur[1] = prev[1];
+      if( prev[1] < 8 ) continue;
+
+      // quadrics of the mesh's own triangles, weighted by area
+      const IqmTriangle *src = prev[0] < mdl->num_tris ? &mdl->tris[prev[0]] : &mdl->lod_tris[prev[0] - mdl->num_tris];
+      memset( q, 0, sizeof(Quadric)*mdl->num_verts );
+      IqmMesh *m = &mdl->meshes[i];
+      for( j = m->first_triangle; j < (int) (m->first_triangle + m->num_triangles); j++ ) {
+        unsigned int *v = mdl->tris[j].vertex;
+        GVec nrm;
+        tri_normal( mdl, v[0], v[1], v[2], &nrm );
+        float area = g_vec_mag( &nrm );
+        if( area <= 0 ) continue;
+        g_vec_mul_scalar( &nrm, &nrm, 1 / area );
+        double d = -g_vec_dot( &nrm, &mdl->verts[v[0]].loc );
+        for( k = 0; k < 3; k++ ) quadric_add_plane( &q[v[k]], nrm.x, nrm.y, nrm.z, d, 0.5*area );
       }
 
+      memcpy( work, src, sizeof(IqmTriangle)*prev[1] );
+      int n = simplify( mdl, work, prev[1], prev[1]/2, q );
+      if( n > prev[1] * 9 / 10 ) continue; // not worth a level
+
+      if( mdl->flags & GM_OPTIMIZE ) optimize_tri_order( work, n, mdl->num_verts );
+      memcpy( &mdl->lod_tris[mdl->num_lod_tris], work, sizeof(IqmTriangle)*n );
+      cur[0] = mdl->num_tris + mdl->num_lod_tris;
+      cur[1] = n;
+      mdl->num_lod_tris += n;
+      reduced = 1;
+    }
+    if( !reduced ) break;
+    mdl->num_lods = level+1;
+  }
+  mdl->lod_tris = g_renew( IqmTriangle, mdl->lod_tris, mdl->num_lod_tris ? mdl->num_lod_tris : 1 );
+  g_free( work );
+  g_free( q );
+
+  for( level = 1; level < mdl->num_lods; level++ ) {
+    int total = 0;
+    for( i = 0; i < mdl->num_meshes; i++ ) total += mdl->lod_ranges[2*(level*mdl->num_meshes + i) + 1];
+    g_debug_str( "%s: LOD %d, %d of %d triangles\n", filename, level, total, mdl->num_tris );
+  }
+}
+
+//
+// Collision (GM_COLLISION)
+//
+// Binned SAH build over the triangle centroids. A split must beat testing the whole node
+// as a leaf, leaves are tested 4 triangles at a time
+typedef struct {
+  float min[3], max[3];
+} Aabb;
+
+typedef struct {
+  GModel *mdl;
+  int *order;      // triangles, partitioned as the tree is built
+  Aabb *boxes;
+  float *centers;  // 3 per triangle
+} BvhBuild;
+
+static void aabb_empty( Aabb *b ) {
+  b->min[0] = b->min[1] = b->min[2] = FLT_MAX;
+  b->max[0] = b->max[1] = b->max[2] = -FLT_MAX;
+}
+
+static void aabb_grow( Aabb *b, const Aabb *o ) {
+  int k;
+  for( k = 0; k < 3; k++ ) {
+    b->min[k] = fminf( b->min[k], o->min[k] );
+    b->max[k] = fmaxf( b->max[k], o->max[k] );
+  }
+}
+
+static float aabb_area( const Aabb *b ) {
+  float x = b->max[0] - b->min[0], y = b->max[1] - b->min[1], z = b->max[2] - b->min[2];
+  return x < 0 ? 0 : x*y + y*z + z*x;
+}
+
+static void bvh_leaf( BvhBuild *b, BvhNode *node, int first, int count ) {
+  GModel *mdl = b->mdl;
+  int i, k, lane;
+  node->first = mdl->num_bvh_blocks;
+  node->count = (count + 3) / 4;
+  for( i = 0; i < node->count; i++ ) {
+    TriBlock *blk = &mdl->bvh_blocks[mdl->num_bvh_blocks++];
+    memset( blk, 0, sizeof(TriBlock) );
+    for( lane = 0; lane < 4; lane++ ) {
+      int j = 4*i + lane;
+      blk->tri[lane] = j < count ? b->order[first + j] : -1;
+      if( j >= count ) continue;
+      const unsigned int *v = mdl->tris[blk->tri[lane]].vertex;
+      const float *p0 = &mdl->verts[v[0]].loc.x, *p1 = &mdl->verts[v[1]].loc.x, *p2 = &mdl->verts[v[2]].loc.x;
+      for( k = 0; k < 3; k++ ) {
+        blk->v0[k][lane] = p0[k];
+        blk->e1[k][lane] = p1[k] - p0[k];
+        blk->e2[k][lane] = p2[k] - p0[k];
+      }
+    }
+  }
+}
+
+static void bvh_node( BvhBuild *b, int first, int count, int depth ) {
+  GModel *mdl = b->mdl;
+  int index = mdl->num_bvh_nodes++, i, k, axis = -1, split = 0;
+  Aabb box, centers;
+  aabb_empty( &box );
+  aabb_empty( &centers );
+  for( i = first; i < first + count; i++ ) {
+    const float *c = &b->centers[3*b->order[i]];
+    Aabb p = { { c[0], c[1], c[2] }, { c[0], c[1], c[2] } };
+    aabb_grow( &box, &b->boxes[b->order[i]] );
+    aabb_grow( &centers, &p );
+  }
+  memcpy( mdl->bvh_nodes[index].min, box.min, sizeof(box.min) );
+  memcpy( mdl->bvh_nodes[index].max, box.max, sizeof(box.max) );
+
+  // cost in triangle tests, one node visit counts as one
+  float best = count, area = aabb_area( &box );
+  for( k = 0; k < 3 && count > 4 && area > 0 && depth < BVH_MAX_DEPTH/2; k++ ) {
+    float lo = centers.min[k], extent = centers.max[k] - lo;
+    if( extent <= 0 ) continue;
+    Aabb bins[BVH_BINS], acc;
+    int counts[BVH_BINS] = { 0 }, n = 0;
+    float left[BVH_BINS];
+    for( i = 0; i < BVH_BINS; i++ ) aabb_empty( &bins[i] );
+    for( i = first; i < first + count; i++ ) {
+      int t = b->order[i], bin = (int) ((b->centers[3*t+k] - lo) / extent * BVH_BINS);
+      bin = bin < BVH_BINS ? bin : BVH_BINS-1;
+      counts[bin]++;
+      aabb_grow( &bins[bin], &b->boxes[t] );
+    }
+    aabb_empty( &acc );
+    for( i = 0; i < BVH_BINS-1; i++ ) { // left[i] covers bins 0..i
+      aabb_grow( &acc, &bins[i] );
+      n += counts[i];
+      left[i] = aabb_area( &acc ) * n;
+    }
+    aabb_empty( &acc );
+    n = 0;
+    for( i = BVH_BINS-1; i > 0; i-- ) {
+      aabb_grow( &acc, &bins[i] );
+      n += counts[i];
+      float cost = 1 + (left[i-1] + aabb_area( &acc ) * n) / area;
+      if( n < count && n > 0 && cost < best ) {
+        best = cost;
+        axis = k;
+        split = i;
+      }
+    }
+  }
+
+  if( axis < 0 && count <= BVH_LEAF_TRIS ) {
+    bvh_leaf( b, &mdl->bvh_nodes[index], first, count );
+    return;
+  }
+
+  int mid = first + count/2; // when every centroid is the same or the tree is too deep
+  if( axis >= 0 ) {
+    float lo = centers.min[axis], extent = centers.max[axis] - lo;
+    int *l = &b->order[first], *r = &b->order[first + count - 1];
+    while( l <= r ) {
+      int bin = (int) ((b->centers[3*(*l)+axis] - lo) / extent * BVH_BINS);
+      if( (bin < BVH_BINS ? bin : BVH_BINS-1) < split ) l++;
+      else {
+        int t = *l; *l = *r; *r-- = t;
+      }
+    }
+    mid = (int) (l - b->order);
+  }
+  bvh_node( b, first, mid - first, depth + 1 );
+  mdl->bvh_nodes[index].first = mdl->num_bvh_nodes;
+  mdl->bvh_nodes[index].count = 0;
+  bvh_node( b, mid, first + count - mid, depth + 1 );
+}
+
+static void build_bvh( GModel *mdl, const char *filename ) {
+  int i, k, n = mdl->num_tris;
+  if( !n ) return;
+  BvhBuild b = { mdl, g_new( int, n ), g_new( Aabb, n ), g_new( float, 3*n ) };
+  for( i = 0; i < n; i++ ) {
+    const unsigned int *v = mdl->tris[i].vertex;
+    b.order[i] = i;
+    for( k = 0; k < 3; k++ ) {
+      float a = (&mdl->verts[v[0]].loc.x)[k], c = (&mdl->verts[v[1]].loc.x)[k], d = (&mdl->verts[v[2]].loc.x)[k];
+      b.boxes[i].min[k] = fminf( a, fminf( c, d ) );
+      b.boxes[i].max[k] = fmaxf( a, fmaxf( c, d ) );
+      b.centers[3*i+k] = (b.boxes[i].min[k] + b.boxes[i].max[k]) * 0.5f;
+    }
+  }
+
+  // a leaf holds at least one triangle, so there are fewer blocks than triangles
+  mdl->bvh_nodes = g_new( BvhNode, 2*n );
+  mdl->bvh_blocks = g_new( TriBlock, n );
+  mdl->num_bvh_nodes = mdl->num_bvh_blocks = 0;
+  bvh_node( &b, 0, n, 0 );
+  mdl->bvh_nodes = g_renew( BvhNode, mdl->bvh_nodes, mdl->num_bvh_nodes );
+  mdl->bvh_blocks = g_renew( TriBlock, mdl->bvh_blocks, mdl->num_bvh_blocks );
+  g_debug_str( "%s: BVH of %d nodes, %d triangle blocks\n", filename, mdl->num_bvh_nodes, mdl->num_bvh_blocks );
+
+  g_free( b.order );
+  g_free( b.boxes );
+  g_free( b.centers );
+}
+
+typedef struct {
+  GVec o, d, inv;
+} Ray;
+
+// entry distance into the node's box, FLT_MAX if the ray misses it before 'tmax'
+static float ray_box( const Ray *r, const BvhNode *n, float tmax ) {
+  const float *o = &r->o.x, *inv = &r->inv.x;
+  float lo = 0, hi = tmax;
+  int k;
+  for( k = 0; k < 3; k++ ) {
+    float near = ((inv[k] < 0 ? n->max[k] : n->min[k]) - o[k]) * inv[k];
+    float far = ((inv[k] < 0 ? n->min[k] : n->max[k]) - o[k]) * inv[k];
+    // an origin on a plane of an axis the ray runs along gives 0*inf = NaN, which fmaxf/fminf skip
+    lo = fmaxf( near, lo );
+    hi = fminf( far, hi );
+  }
+  hi *= 1 + 4*FLT_EPSILON; // rounding must not cull rays through an edge or corner of the box
+  return lo <= hi ? lo : FLT_MAX;
+}
+
+// Moller-Trumbore on the 4 triangles, both faces hit. Updates 'hit' with a closer one
+static void ray_block( const Ray *r, const TriBlock *blk, GRayHit *hit ) {
+#ifdef G_SSE
+  const __m128 eps = _mm_set1_ps( 1e-12f ), sign = _mm_set1_ps( -0.0f );
+  __m128 dx = _mm_set1_ps( r->d.x ), dy = _mm_set1_ps( r->d.y ), dz = _mm_set1_ps( r->d.z );
+  __m128 e1x = _mm_loadu_ps( blk->e1[0] ), e1y = _mm_loadu_ps( blk->e1[1] ), e1z = _mm_loadu_ps( blk->e1[2] );
+  __m128 e2x = _mm_loadu_ps( blk->e2[0] ), e2y = _mm_loadu_ps( blk->e2[1] ), e2z = _mm_loadu_ps( blk->e2[2] );
+
+  __m128 px = _mm_sub_ps( _mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y) ); // d x e2
+  __m128 py = _mm_sub_ps( _mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z) );
+  __m128 pz = _mm_sub_ps( _mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x) );
+  __m128 det = _mm_add_ps( _mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz) );
+  __m128 valid = _mm_cmpgt_ps( _mm_andnot_ps(sign, det), eps );
+  __m128 inv = _mm_div_ps( _mm_set1_ps(1.0f), _mm_or_ps(_mm_and_ps(det, valid), _mm_andnot_ps(valid, _mm_set1_ps(1.0f))) );
+
+  __m128 tx = _mm_sub_ps( _mm_set1_ps(r->o.x), _mm_loadu_ps(blk->v0[0]) );
+  __m128 ty = _mm_sub_ps( _mm_set1_ps(r->o.y), _mm_loadu_ps(blk->v0[1]) );
+  __m128 tz = _mm_sub_ps( _mm_set1_ps(r->o.z), _mm_loadu_ps(blk->v0[2]) );
+  __m128 u = _mm_mul_ps( _mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv );
+
+  __m128 qx = _mm_sub_ps( _mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y) ); // t x e1
+  __m128 qy = _mm_sub_ps( _mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z) );
+  __m128 qz = _mm_sub_ps( _mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x) );
+  __m128 v = _mm_mul_ps( _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv );
+  __m128 t = _mm_mul_ps( _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv );
+
+  const __m128 zero = _mm_setzero_ps();
+  valid = _mm_and_ps( valid, _mm_cmpge_ps(u, zero) );
+  valid = _mm_and_ps( valid, _mm_cmpge_ps(v, zero) );
+  valid = _mm_and_ps( valid, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)) );
+  valid = _mm_and_ps( valid, _mm_cmpge_ps(t, zero) );
+  valid = _mm_and_ps( valid, _mm_cmplt_ps(t, _mm_set1_ps(hit->t)) );
+  int mask = _mm_movemask_ps( valid ), lane;
+  if( !mask ) return;
+
+  float ts[4], us[4], vs[4];
+  _mm_storeu_ps( ts, t ); _mm_storeu_ps( us, u ); _mm_storeu_ps( vs, v );
+  for( lane = 0; lane < 4; lane++ )
+    if( (mask & (1 << lane)) && ts[lane] < hit->t ) {
+      hit->t = ts[lane]; hit->u = us[lane]; hit->v = vs[lane];
+      hit->tri = blk->tri[lane];
+    }
+#else
+  int lane;
+  for( lane = 0; lane < 4; lane++ ) {
+    GVec e1 = { blk->e1[0][lane], blk->e1[1][lane], blk->e1[2][lane] };
+    GVec e2 = { blk->e2[0][lane], blk->e2[1][lane], blk->e2[2][lane] };
+    GVec p = { r->d.y*e2.z - r->d.z*e2.y, r->d.z*e2.x - r->d.x*e2.z, r->d.x*e2.y - r->d.y*e2.x };
+    float det = e1.x*p.x + e1.y*p.y + e1.z*p.z;
+    if( fabsf( det ) <= 1e-12f ) continue;
+    float inv = 1 / det;
+    GVec s = { r->o.x - blk->v0[0][lane], r->o.y - blk->v0[1][lane], r->o.z - blk->v0[2][lane] };
+    float u = (s.x*p.x + s.y*p.y + s.z*p.z) * inv;
+    if( u < 0 || u > 1 ) continue;
+    GVec q = { s.y*e1.z - s.z*e1.y, s.z*e1.x - s.x*e1.z, s.x*e1.y - s.y*e1.x };
+    float v = (r->d.x*q.x + r->d.y*q.y + r->d.z*q.z) * inv;
+    float t = (e2.x*q.x + e2.y*q.y + e2.z*q.z) * inv;
+    if( v < 0 || u + v > 1 || t < 0 || t >= hit->t ) continue;
+    hit->t = t; hit->u = u; hit->v = v;
+    hit->tri = blk->tri[lane];
+  }
+#endif
+}
+
+static int loadiqmmeshes( GModel *mdl, const char *filename, const iqmheader *hdr, unsigned char *buf ) {
+  mdl->num_meshes = hdr->num_meshes;
+  mdl->num_tris = hdr->num_triangles;
+  mdl->num_verts = hdr->num_vertexes;
+  mdl->num_joints = hdr->num_joints;
+
+  if( !iqm_in_file( hdr, hdr->ofs_meshes, hdr->num_meshes, sizeof(IqmMesh) ) ||
+      !iqm_in_file( hdr, hdr->ofs_vertexarrays, hdr->num_vertexarrays, sizeof(IqmVertexArray) ) ||
+      !iqm_in_file( hdr, hdr->ofs_triangles, hdr->num_triangles, sizeof(IqmTriangle) ) ||
+      !iqm_in_file( hdr, hdr->ofs_joints, hdr->num_joints, sizeof(IqmJoint) ) )
+    return 0;
+
+  // triangles, meshes and joints are used straight from the mapping
+  mdl->meshes = (IqmMesh *) &buf[hdr->ofs_meshes];
+  mdl->tris = (IqmTriangle *) &buf[hdr->ofs_triangles];
+  mdl->joints = (IqmJoint *) &buf[hdr->ofs_joints];
+  //    if( hdr->ofs_adjacency ) adjacency = ( IqmTriangle *) &buf[hdr->ofs_adjacency];
+  mdl->verts = g_new( IqmVertex, mdl->num_verts );
+  mdl->attribs = g_new0( IqmVertexAttribs, mdl->num_verts );
+
+  IqmVertexArray *vas = (IqmVertexArray *)&buf[hdr->ofs_vertexarrays];
+
+  float *loc=NULL, *normal=NULL, *texcoord=NULL, *tangent=NULL;
+  unsigned char *blendindex = NULL, *blendweight=NULL;
+
+  int i,j;
+  for( i = 0; i < (int)hdr->num_vertexarrays; i++ ) {
+    IqmVertexArray *va = &vas[i];
+    unsigned int compsize = va->format == IQM_FLOAT ? sizeof(float) : sizeof(unsigned char);
+    // a size of 0 would divide by zero in iqm_in_file(), the arrays read below have 2 to 4 components
+    if( va->type <= IQM_BLENDWEIGHTS && (va->size < 1 || va->size > 4 ||
+        !iqm_in_file( hdr, va->offset, hdr->num_vertexes, va->size*compsize )) ) return 0;
+
+    switch(va->type) {
+      case IQM_POSITION:
+      if(va->format != IQM_FLOAT || va->size != 3) return 0;
+      loc = (float *) &buf[va->offset];
+      break;
+
+      case IQM_NORMAL:
+      if(va->format != IQM_FLOAT || va->size != 3) return 0;
+      normal = (float *) &buf[va->offset];
+      break;
+
+      case IQM_TANGENT:
+      if(va->format != IQM_FLOAT || va->size != 4) return 0;
+      tangent = (float *) &buf[va->offset];
+      break;
+
+      case IQM_TEXCOORD:
+      if(va->format != IQM_FLOAT || va->size != 2) return 0;
+      texcoord = (float *) &buf[va->offset];
+      break;
+
+      case IQM_BLENDINDEXES:
+      if(va->format != IQM_UBYTE || va->size != 4) return 0;
+      blendindex = (unsigned char*) &buf[va->offset];
+      break;
+
+      case IQM_BLENDWEIGHTS:
+      if(va->format != IQM_UBYTE || va->size != 4) return 0;
+      blendweight = (unsigned char*) &buf[va->offset];
+      break;
+    }
+  }
+
+  for( j=0; j<mdl->num_verts; j++ ){
+    IqmVertex *v = &mdl->verts[j];
+    IqmVertexAttribs *a = &mdl->attribs[j];
+    if( loc ) memcpy( &v->loc, &loc[j*3], sizeof(GVec) );
+    if( normal ) memcpy( &a->normal, &normal[j*3], sizeof(GVec) );
+    if( tangent ) memcpy( &a->tangent, &tangent[j*4], sizeof(GVec4) );
+    if( texcoord ) memcpy( &a->texcoord, &texcoord[j*2], sizeof(GVec2) );
+    if( blendindex ) memcpy( &v->blendindex, &blendindex[j*4], sizeof(unsigned char)*4 );
+    if( blendweight ) memcpy( &v->blendweight, &blendweight[j*4], sizeof(unsigned char)*4 );
+    // the skinning paths index the joint palette with it, build_influences() would skip it
+    if( blendindex && blendweight )
+      for( i = 0; i < 4; i++ )
+        if( v->blendweight[i] && v->blendindex[i] >= mdl->num_joints ) {
+          g_debug_str("%s: vertex %d is weighted to joint %d of %d\n", filename, j, v->blendindex[i], mdl->num_joints);
+          return 0;
+        }
+  }
+
+  for( i = 0; i < mdl->num_meshes; i++ ) {
+    IqmMesh *m = &mdl->meshes[i];
+    if( m->first_triangle > hdr->num_triangles || m->num_triangles > hdr->num_triangles - m->first_triangle ) return 0;
+    if( m->first_vertex > hdr->num_vertexes || m->num_vertexes > hdr->num_vertexes - m->first_vertex ) return 0;
+  }
+  for( i = 0; i < mdl->num_tris; i++ )
+    for( j = 0; j < 3; j++ )
+      if( mdl->tris[i].vertex[j] >= hdr->num_vertexes ) return 0;
+
+  if( mdl->flags & GM_OPTIMIZE ) optimize_meshes( mdl, filename );
+  build_lods( mdl, filename );
+
+  mdl->base = g_new( GDualQuat, hdr->num_joints );
+  mdl->inversebase = g_new( GDualQuat, hdr->num_joints );
+  for( i = 0; i < (int) hdr->num_joints; i++ ) {
+    IqmJoint *j = &mdl->joints[i];
+    if( j->parent >= i ) { // the hierarchy is walked in one pass, parents must come first
+      g_debug_str("%s: joint %d comes before its parent\n", filename, i);
+      return 0;
+    }
+    GQuat rotate = j->rotate; // the mapping is read only
+    g_quat_normalize( &rotate );
+    g_dual_quat_from_quat_vec( &mdl->base[i], &rotate, &j->translate );
+
+    if( j->parent >= 0)
+      g_dual_quat_mul( &mdl->base[i], &mdl->base[j->parent], &mdl->base[i] );
+
+    g_dual_quat_invert( &mdl->inversebase[i], &mdl->base[i] );
+  }
+
+  GVec lo = { 0, 0, 0 }, hi = { 0, 0, 0 };
+  if( mdl->num_verts ) lo = hi = mdl->verts[0].loc;
+  for( i = 0; i < mdl->num_verts; i++ ) {
+    GVec *p = &mdl->verts[i].loc;
+    lo.x = fminf( lo.x, p->x ); hi.x = fmaxf( hi.x, p->x );
+    lo.y = fminf( lo.y, p->y ); hi.y = fmaxf( hi.y, p->y );
+    lo.z = fminf( lo.z, p->z ); hi.z = fmaxf( hi.z, p->z );
+  }
+  GBounds *b = &mdl->bind_bounds;
+  b->min = lo;
+  b->max = hi;
+  g_vec_add( &b->center, &lo, &hi );
+  g_vec_mul_scalar( &b->center, &b->center, 0.5f );
+  for( i = 0; i < mdl->num_verts; i++ ) // tighter than the box for the bind pose
+    b->radius = fmaxf( b->radius, g_vec_dist( &b->center, &mdl->verts[i].loc ) );
+
+  return 1;
+}
+
+// Concatenate each pose with the inverse base pose to avoid doing this at animation time.
+// If the joint has a parent, then it needs to be pre-concatenated with its parent's base pose.
+// Thus it all negates at animation time like so:
+//   (parentPose * parentInverseBasePose) * (parentBasePose * childPose * childInverseBasePose) =>
+//   parentPose * (parentInverseBasePose * parentBasePose) * childPose * childInverseBasePose =>
+//   parentPose * childPose * childInverseBasePose
+static void pose_to_frame( GModel *mdl, int j, GQuat *rotate, GVec *translate, GDualQuat *out ) {
+  g_quat_normalize( rotate );
+
+  g_dual_quat_from_quat_vec( out, rotate, translate );
+  g_dual_quat_mul( out, out, &mdl->inversebase[j] );
+
+  if( mdl->poses[j].parent >= 0)
+    g_dual_quat_mul( out, &mdl->base[mdl->poses[j].parent], out );
+}
+
+// Spreads the variable number of channels each pose has in the file to 8 per joint
+static void pack_anim_channels( GModel *mdl, const iqmheader *hdr, unsigned short *framedata ) {
+  int i, j, c;
+  mdl->channels = g_new0( AnimChannels, hdr->num_poses );
+  mdl->anim_data = g_new0( unsigned short, 8 * hdr->num_frames * hdr->num_poses );
+
+  for( j = 0; j < mdl->num_joints; j++ )
+    for( c = 0; c < 7; c++ ) {
+      mdl->channels[j].offset[c] = mdl->poses[j].channeloffset[c];
+      if( mdl->poses[j].mask & (1<<c) ) mdl->channels[j].scale[c] = mdl->poses[j].channelscale[c];
+    }
+
+  unsigned short *dst = mdl->anim_data;
+  for( i = 0; i < mdl->num_frames; i++ )
+    for( j = 0; j < mdl->num_joints; j++, dst += 8 )
+      for( c = 0; c < 7; c++ )
+        if( mdl->poses[j].mask & (1<<c) ) dst[c] = *framedata++;
+}
+
+// Joint 'j' of 'frame' as it is stored in mdl->frames, compressed ones are decoded to 'tmp'
+static GDualQuat* frame_joint( GModel *mdl, int frame, int j, GDualQuat *tmp ) {
+  if( mdl->frames ) return &mdl->frames[frame*mdl->num_joints + j];
+
+  const unsigned short *src = &mdl->anim_data[8*(frame*mdl->num_joints + j)];
+  AnimChannels *ch = &mdl->channels[j];
+  float v[8];
+#ifdef G_SSE2
+  __m128i raw = _mm_loadu_si128( (const __m128i*) src ), zero = _mm_setzero_si128();
+  __m128 lo = _mm_cvtepi32_ps( _mm_unpacklo_epi16( raw, zero ) );
+  __m128 hi = _mm_cvtepi32_ps( _mm_unpackhi_epi16( raw, zero ) );
+  _mm_storeu_ps( v,   _mm_add_ps( _mm_loadu_ps(ch->offset),   _mm_mul_ps( lo, _mm_loadu_ps(ch->scale) ) ) );
+  _mm_storeu_ps( v+4, _mm_add_ps( _mm_loadu_ps(ch->offset+4), _mm_mul_ps( hi, _mm_loadu_ps(ch->scale+4) ) ) );
+#else
+  int c;
+  for( c = 0; c < 8; c++ ) v[c] = ch->offset[c] + src[c] * ch->scale[c];
+#endif
+
+  GVec translate = { v[0], v[1], v[2] };
+  GQuat rotate = { v[3], v[4], v[5], v[6] };
+  pose_to_frame( mdl, j, &rotate, &translate, tmp );
+  return tmp;
+}
+
       static int loadiqmanims( GModel* mdl, const char *filename, const iqmheader *hdr, unsigned char *buf ) {
         if((int)hdr->num_poses != mdl->num_joints) return 0;
 
-        const char *str = hdr->ofs_text ? (char *)&buf[hdr->ofs_text] : "";
+        if( !iqm_in_file( hdr, hdr->ofs_poses, hdr->num_poses, sizeof(IqmPose) ) ||
+            !iqm_in_file( hdr, hdr->ofs_anims, hdr->num_anims, sizeof(IqmAnim) ) ||
+            // divided rather than multiplied, the product could wrap around
+            (hdr->num_framechannels && hdr->num_frames > 0xffffffffu / hdr->num_framechannels) ||
+            !iqm_in_file( hdr, hdr->ofs_frames, hdr->num_frames * hdr->num_framechannels, sizeof(unsigned short) ) ||
+            (hdr->ofs_bounds && !iqm_in_file( hdr, hdr->ofs_bounds, hdr->num_frames, sizeof(IqmBounds) )) )
+          return 0;
+
         mdl->num_anims = hdr->num_anims;
         mdl->num_frames = hdr->num_frames;
         mdl->anims = (IqmAnim *)&buf[hdr->ofs_anims];
         mdl->poses = (IqmPose *)&buf[hdr->ofs_poses];
-        mdl->frames = g_new( GDualQuat, hdr->num_frames * hdr->num_poses );
-        mdl->outframe = g_new( GDualQuat, hdr->num_joints);
-        mdl->out_verts = g_new( IqmVertex, mdl->num_verts );
+#ifdef G_SSE
+        build_skin_blocks( mdl );
+#endif
 
-    //TODO: load bounds data
         unsigned short *framedata = (unsigned short *)&buf[hdr->ofs_frames];
-//    if( hdr->ofs_bounds ) mdl->bounds = (IqmBounds *)&buf[hdr->ofs_bounds];
-
-        int i, j;
-        for( i = 0; i < (int)hdr->num_frames; i++ ) {
-          for( j = 0; j < (int)hdr->num_poses; j++ ) {
-            IqmPose *p = &mdl->poses[j];
-            GQuat rotate;
-            GVec translate;
-
-            translate.x = p->channeloffset[0]; if(p->mask&0x01) translate.x += *framedata++ * p->channelscale[0];
-            translate.y = p->channeloffset[1]; if(p->mask&0x02) translate.y += *framedata++ * p->channelscale[1];
-            translate.z = p->channeloffset[2]; if(p->mask&0x04) translate.z += *framedata++ * p->channelscale[2];
-
-            rotate.x = p->channeloffset[3]; if(p->mask&0x08) rotate.x += *framedata++ * p->channelscale[3];
-            rotate.y = p->channeloffset[4]; if(p->mask&0x10) rotate.y += *framedata++ * p->channelscale[4];
-            rotate.z = p->channeloffset[5]; if(p->mask&0x20) rotate.z += *framedata++ * p->channelscale[5];
-            rotate.w = p->channeloffset[6]; if(p->mask&0x40) rotate.w += *framedata++ * p->channelscale[6];
-
-            if( p->mask&0x80 || p->mask&0x100 || p->mask&0x200 ){
-              g_debug_str("bone scaling is disabled...\n");
-              return 0;
-            }
-
-            // Concatenate each pose with the inverse base pose to avoid doing this at animation time.
-            // If the joint has a parent, then it needs to be pre-concatenated with its parent's base pose.
-            // Thus it all negates at animation time like so:
-            //   (parentPose * parentInverseBasePose) * (parentBasePose * childPose * childInverseBasePose) =>
-            //   parentPose * (parentInverseBasePose * parentBasePose) * childPose * childInverseBasePose =>
-            //   parentPose * childPose * childInverseBasePose
-            int k = i*hdr->num_poses + j;
-            g_quat_normalize( &rotate );
-
-            g_dual_quat_from_quat_vec( &mdl->frames[k], &rotate, &translate );
-            g_dual_quat_mul( &mdl->frames[k], &mdl->frames[k], &mdl->inversebase[j] );
+        if( hdr->ofs_bounds ) mdl->bounds = (IqmBounds *)&buf[hdr->ofs_bounds];
+
+        int i, j, c;
+        unsigned int channels = 0;
+        for( j = 0; j < (int)hdr->num_poses; j++ ) {
+          if( mdl->poses[j].mask&0x80 || mdl->poses[j].mask&0x100 || mdl->poses[j].mask&0x200 ){
+            g_debug_str("bone scaling is disabled...\n");
+            return 0;
+          }
+          if( mdl->poses[j].parent >= j ) { // pose_to_frame() indexes the base pose with it
+            g_debug_str("%s: pose %d comes before its parent\n", filename, j);
+            return 0;
+          }
+          for( c = 0; c < 7; c++ ) channels += (mdl->poses[j].mask >> c) & 1;
+        }
+        // every frame reads one value per set bit of the masks, that has to be what was checked above
+        if( channels != hdr->num_framechannels ) {
+          g_debug_str("%s: poses have %u channels, the frames %u\n", filename, channels, hdr->num_framechannels);
+          return 0;
+        }
 
-            if( p->parent >= 0)
-              g_dual_quat_mul( &mdl->frames[k], &mdl->base[p->parent], &mdl->frames[k] );
+        if( mdl->flags & GM_COMPRESS_ANIMS ) pack_anim_channels( mdl, hdr, framedata );
+        else {
+          mdl->frames = g_new( GDualQuat, hdr->num_frames * hdr->num_poses );
+          for( i = 0; i < (int)hdr->num_frames; i++ ) {
+            for( j = 0; j < (int)hdr->num_poses; j++ ) {
+              IqmPose *p = &mdl->poses[j];
+              GQuat rotate;
+              GVec translate;
+
+              translate.x = p->channeloffset[0]; if(p->mask&0x01) translate.x += *framedata++ * p->channelscale[0];
+              translate.y = p->channeloffset[1]; if(p->mask&0x02) translate.y += *framedata++ * p->channelscale[1];
+              translate.z = p->channeloffset[2]; if(p->mask&0x04) translate.z += *framedata++ * p->channelscale[2];
+
+              rotate.x = p->channeloffset[3]; if(p->mask&0x08) rotate.x += *framedata++ * p->channelscale[3];
+              rotate.y = p->channeloffset[4]; if(p->mask&0x10) rotate.y += *framedata++ * p->channelscale[4];
+              rotate.z = p->channeloffset[5]; if(p->mask&0x20) rotate.z += *framedata++ * p->channelscale[5];
+              rotate.w = p->channeloffset[6]; if(p->mask&0x40) rotate.w += *framedata++ * p->channelscale[6];
+
+              pose_to_frame( mdl, j, &rotate, &translate, &mdl->frames[i*hdr->num_poses + j] );
+            }
           }
         }
 
         for( i = 0; i < (int)hdr->num_anims; i++ ) {
           IqmAnim *a = &mdl->anims[i];
-          printf("%s: loaded anim: %s\n", filename, &str[a->name]);
+          if( a->first_frame > hdr->num_frames || a->num_frames > hdr->num_frames - a->first_frame ) return 0;
+          printf("%s: loaded anim: %s\n", filename, &mdl->text[a->name]);
         }
 
-        g_free( mdl->base );
-        g_free( mdl->inversebase );
+        // compressed frames are decoded against the inverse base pose every time they are sampled,
+        // the base pose itself is kept for the joint queries
+        if( !mdl->anim_data ) {
+          g_free( mdl->inversebase );
+          mdl->inversebase = NULL;
+        }
 
         return 1;
       }
 
-      static void animateiqm( GModel *mdl, float curframe ) {
-        if(!mdl->num_frames) return;
-        int i, j;
-
-        int frame1 = (int)floor(curframe), frame2 = frame1 + 1;
-        float frameoffset = curframe - frame1;
-        frame1 %= mdl->num_frames;
-        frame2 %= mdl->num_frames;
-        GDualQuat *d1 = &mdl->frames[frame1 * mdl->num_joints],
-        *d2 = &mdl->frames[frame2 * mdl->num_joints];
-
-    // Interpolate matrixes between the two closest frames and concatenate with parent matrix if necessary.
-    // Concatenate the result with the inverse of the base pose.
-    // You would normally do animation blending and inter-frame blending here in a 3D engine.
-        for( i = 0; i < mdl->num_joints; i++ ) {
-        GDualQuat r;// = d1[i];
-        g_dual_quat_lerp( &r, &d1[i], &d2[i], frameoffset );
-        if( mdl->joints[i].parent >= 0) g_dual_quat_mul( &mdl->outframe[i], &mdl->outframe[mdl->joints[i].parent], &r );
-        else mdl->outframe[i] = r;
+// writes the joint palette for 'curframe' to 'outframe'
+static void animate_joints( GModel *mdl, GDualQuat *outframe, float curframe ) {
+  int i;
+
+  int frame1 = (int)floor(curframe), frame2;
+  float frameoffset = curframe - frame1;
+  frame1 %= mdl->num_frames;
+  if( frame1 < 0 ) frame1 += mdl->num_frames;
+  frame2 = (frame1 + 1) % mdl->num_frames;
+  // Interpolate matrixes between the two closest frames and concatenate with parent matrix if necessary.
+  // Concatenate the result with the inverse of the base pose.
+  // You would normally do animation blending and inter-frame blending here in a 3D engine.
+  for( i = 0; i < mdl->num_joints; i++ ) {
+    GDualQuat r, t1, t2;
+    g_dual_quat_lerp( &r, frame_joint( mdl, frame1, i, &t1 ), frame_joint( mdl, frame2, i, &t2 ), frameoffset );
+    if( mdl->joints[i].parent >= 0) g_dual_quat_mul( &outframe[i], &outframe[mdl->joints[i].parent], &r );
+    else outframe[i] = r;
+  }
+}
+
+//
+// Clips and blending
+//
+typedef struct {
+  int frame;
+  float weight;
+} ClipSample;
+
+typedef struct {
+  ClipSample s[2];
+  int ref; // frame the difference is taken from
+  float weight;
+} AdditiveLayer;
+
+// the frames around the layer's time, their weights add up to 'weight'
+static void clip_samples( GModel *mdl, const GAnimLayer *l, float weight, ClipSample *s ) {
+  IqmAnim *a = &mdl->anims[l->clip];
+  int n = a->num_frames, loop = a->flags & IQM_LOOP;
+  float t = l->time * (a->framerate > 0 ? a->framerate : 1);
+
+  if( loop ) {
+    t = fmodf( t, n );
+    if( t < 0 ) t += n;
+  } else t = t < 0 ? 0 : t > n-1 ? n-1 : t;
+
+  int i = (int) t;
+  if( i > n-1 ) i = n-1;
+  t -= i;
+  s[0].frame = a->first_frame + i;
+  s[1].frame = a->first_frame + (i+1 < n ? i+1 : loop ? 0 : i);
+  s[0].weight = weight * (1-t);
+  s[1].weight = weight * t;
+}
+
+// weighted sum of the joint over the samples, normalized, with every sample flipped
+// to the hemisphere of the sum so far like g_dual_quat_scale_add()
+static void blend_joint( GModel *mdl, int j, ClipSample *s, int num_samples, GDualQuat *out ) {
+  GDualQuat tmp;
+  int k;
+#ifdef G_SSE
+  __m128 q = _mm_setzero_ps(), d = _mm_setzero_ps();
+  for( k = 0; k < num_samples; k++ ) {
+    GDualQuat *f = frame_joint( mdl, s[k].frame, j, &tmp );
+    __m128 fq = _mm_loadu_ps( &f->q.x ), fd = _mm_loadu_ps( &f->d.x );
+    __m128 dot = _mm_mul_ps( q, fq );
+    dot = _mm_add_ps( dot, _mm_movehl_ps( dot, dot ) );
+    dot = _mm_add_ss( dot, _mm_shuffle_ps( dot, dot, 1 ) );
+    __m128 w = _mm_set1_ps( _mm_cvtss_f32( dot ) < 0 ? -s[k].weight : s[k].weight );
+    q = _mm_add_ps( q, _mm_mul_ps( fq, w ) );
+    d = _mm_add_ps( d, _mm_mul_ps( fd, w ) );
+  }
+  _mm_storeu_ps( &out->q.x, q );
+  _mm_storeu_ps( &out->d.x, d );
+#else
+  memset( out, 0, sizeof(GDualQuat) );
+  for( k = 0; k < num_samples; k++ )
+    g_dual_quat_scale_add( out, frame_joint( mdl, s[k].frame, j, &tmp ), s[k].weight );
+#endif
+  g_dual_quat_normalize( out );
+}
+
+int g_model_find_clip( GModel *mdl, const char *name ){
+  int i;
+  for( i = 0; i < mdl->num_anims; i++ )
+    if( !strcmp( &mdl->text[mdl->anims[i].name], name ) ) return i;
+  return -1;
+}
+
+int g_model_num_clips( GModel *mdl ){
+  return mdl->num_anims;
+}
+
+float g_model_clip_duration( GModel *mdl, int clip ){
+  if( clip < 0 || clip >= mdl->num_anims ) return 0; // g_model_find_clip() gives -1 for unknown names
+  IqmAnim *a = &mdl->anims[clip];
+  return a->num_frames / (a->framerate > 0 ? a->framerate : 1);
+}
+
+// The regular layers are blended together, then the additive ones apply their
+// difference to the first frame of their clip on top, all in one pass over the joints
+static void pose_layers( GModelInstance *inst, const GAnimLayer *layers, int num_layers ){
+  GModel *mdl = inst->mdl;
+  ClipSample base_stack[16], *base = num_layers > 8 ? g_new( ClipSample, 2*num_layers ) : base_stack;
+  AdditiveLayer add_stack[8], *add = num_layers > 8 ? g_new( AdditiveLayer, num_layers ) : add_stack;
+  int i, j, num_base = 0, num_add = 0;
+
+  for( i = 0; i < num_layers; i++ ) {
+    const GAnimLayer *l = &layers[i];
+    if( l->clip < 0 || l->clip >= mdl->num_anims || !mdl->anims[l->clip].num_frames || l->weight <= 0 ) continue;
+    if( l->additive ) {
+      AdditiveLayer *a = &add[num_add++];
+      clip_samples( mdl, l, 1, a->s );
+      a->ref = mdl->anims[l->clip].first_frame;
+      a->weight = l->weight;
+    } else clip_samples( mdl, l, l->weight, &base[2*num_base++] );
+  }
+
+  for( j = 0; j < mdl->num_joints; j++ ) {
+    GDualQuat r, delta, inv, tmp;
+    blend_joint( mdl, j, base, 2*num_base, &r ); // the bind pose without any regular layer
+
+    for( i = 0; i < num_add; i++ ) {
+      blend_joint( mdl, j, add[i].s, 2, &delta );
+      g_dual_quat_invert( &inv, frame_joint( mdl, add[i].ref, j, &tmp ) );
+      g_dual_quat_mul( &delta, &inv, &delta );
+      if( add[i].weight < 1 ) { // partial difference, blended from the identity
+        tmp = (GDualQuat){{.0, .0, .0, 1 - add[i].weight}, {.0, .0, .0, .0}};
+        g_dual_quat_scale_add( &tmp, &delta, add[i].weight );
+        g_dual_quat_normalize( &tmp );
+        delta = tmp;
       }
+      g_dual_quat_mul( &r, &r, &delta );
+    }
 
-    // The actual vertex generation based on the matrixes follows...
-      for( i = 0; i < mdl->num_verts; i++) {
-        IqmVertex* v = &mdl->verts[i];
-        // weighted blend of bone transformations assigned to this vert ( here for fixed pipeline )
-        GDualQuat r = {{.0, .0, .0, .0}, {.0, .0, .0, .0}};
-        g_dual_quat_scale_add( &r, &mdl->outframe[v->blendindex[0]], (v->blendweight[0]/255.0f) );
-        for( j = 1; j < 4 && v->blendweight[j]; j++ )
-          g_dual_quat_scale_add( &r, &mdl->outframe[v->blendindex[j]], (v->blendweight[j]/255.0f) );
+    if( mdl->joints[j].parent >= 0 ) g_dual_quat_mul( &inst->outframe[j], &inst->outframe[mdl->joints[j].parent], &r );
+    else inst->outframe[j] = r;
+  }
+  inst->skin_valid = 0;
+  inst->last_frame = NAN;
+  inst->pose_slot = -1;
+  inst->frame1 = -1;
+  if( num_base == 1 && !num_add ) {
+    inst->frame1 = base[0].frame;
+    inst->frame2 = base[1].frame;
+    inst->frame_t = base[1].weight / (base[0].weight + base[1].weight);
+  }
 
-        g_dual_quat_normalize( &r );
+  if( base != base_stack ) g_free( base );
+  if( add != add_stack ) g_free( add );
+}
+
+//
+// Pose cache
+//
+// Direct mapped on ( clip, time rounded to pose_step ), all the instances posed with the same
+// single regular layer get the palette of the slot, and unless the skinning is on the GPU, are
+// drawn from its skinned positions. Keys only depend on the clip, so slots stay valid across frames
+static void free_pose_cache( GModel *mdl ) {
+  int i;
+  for( i = 0; i < mdl->pose_slots; i++ ) g_model_instance_destroy( mdl->pose_cache[i].inst );
+  if( mdl->pose_cache ) g_free( mdl->pose_cache );
+  mdl->pose_cache = NULL;
+  mdl->pose_slots = 0;
+}
+
+// poses 'inst' from the cache, 0 if the layers can't be cached
+static int pose_cached( GModelInstance *inst, const GAnimLayer *layers, int num_layers ) {
+  GModel *mdl = inst->mdl;
+  const GAnimLayer *l = layers;
+  if( !mdl->pose_cache || num_layers != 1 || l->additive || l->weight <= 0 ||
+      l->clip < 0 || l->clip >= mdl->num_anims || !mdl->anims[l->clip].num_frames )
+    return 0;
+
+  // wrapped or clamped like clip_samples() first, so every lap shares the same keys
+  float duration = g_model_clip_duration( mdl, l->clip ), t = l->time;
+  if( mdl->anims[l->clip].flags & IQM_LOOP ) {
+    t = fmodf( t, duration );
+    if( t < 0 ) t += duration;
+  } else t = t < 0 ? 0 : t > duration ? duration : t;
+  int time = (int) floorf( t / mdl->pose_step + 0.5f );
+
+  unsigned int h = ((unsigned int) l->clip * 0x9e3779b9u) ^ ((unsigned int) time * 2654435761u);
+  int index = (int) (h % (unsigned int) mdl->pose_slots);
+  PoseSlot *slot = &mdl->pose_cache[index];
+  if( slot->clip == l->clip && slot->time == time ) mdl->pose_stats.hits++;
+  else {
+    GAnimLayer q = { l->clip, time * mdl->pose_step, 1, 0 };
+    pose_layers( slot->inst, &q, 1 );
+    slot->clip = l->clip;
+    slot->time = time;
+    slot->serial = ++mdl->pose_serial;
+    mdl->pose_stats.misses++;
+  }
 
-        // Transform attributes by the blended dual quaternion.
-        IqmVertex* ov = &mdl->out_verts[i];
-        g_dual_quat_vec_mul( &ov->loc, &r, &v->loc );
+  memcpy( inst->outframe, slot->inst->outframe, sizeof(GDualQuat)*mdl->num_joints );
+  inst->frame1 = slot->inst->frame1;
+  inst->frame2 = slot->inst->frame2;
+  inst->frame_t = slot->inst->frame_t;
+  inst->skin_valid = 0;
+  inst->last_frame = NAN;
+  inst->pose_slot = index;
+  inst->pose_serial = slot->serial;
+  return 1;
+}
+
+void g_model_instance_pose( GModelInstance *inst, const GAnimLayer *layers, int num_layers ){
+  inst->culled = 0; // posed outside g_anim_lod_update(), it's drawn again
+  if( !pose_cached( inst, layers, num_layers ) ) pose_layers( inst, layers, num_layers );
+}
+
+void g_model_set_pose_cache( GModel *mdl, int slots, float step ){
+  int i;
+  free_pose_cache( mdl );
+  memset( &mdl->pose_stats, 0, sizeof(mdl->pose_stats) );
+  if( slots <= 0 || step <= 0 || !mdl->num_anims ) return;
+  mdl->pose_cache = g_new( PoseSlot, slots );
+  mdl->pose_slots = slots;
+  mdl->pose_step = step;
+  for( i = 0; i < slots; i++ ) {
+    mdl->pose_cache[i].inst = g_model_instance_new( mdl );
+    mdl->pose_cache[i].clip = -1;
+    mdl->pose_cache[i].serial = ++mdl->pose_serial; // no instance holds it yet
+  }
+}
 
-//  *dstnorm = matnorm.transform(*srcnorm);
-        // Note that input tangent data has 4 coordinates,
-        // so only transform the first 3 as the tangent vector.
-//  *dsttan = matnorm.transform(Vec3(*srctan));
-        // Note that bitangent = cross(normal, tangent) * sign,
-        // where the sign is stored in the 4th coordinate of the input tangent data.
-//  *dstbitan = dstnorm->cross(*dsttan) * srctan->w;
+void g_model_pose_cache_stats( GModel *mdl, GPoseCacheStats *stats ){
+  *stats = mdl->pose_stats;
+  unsigned int total = stats->hits + stats->misses;
+  stats->hit_rate = total ? (float) stats->hits / total : 0;
+}
+
+//
+// Batched poses, 4 instances of the same model at a time
+//
+typedef struct {
+  GModel *mdl;
+  GModelInstance **insts;
+  const GAnimLayer *layers;
+  int *index; // instances posed in the lanes, the others go through g_model_instance_pose()
+  int count;
+} PoseBatch;
+
+#ifdef G_SSE
+typedef struct {
+  __m128 qx, qy, qz, qw, dx, dy, dz, dw;
+} DualQuat4; // one dual quat per lane
+
+static void dual_quat4_load( DualQuat4 *r, GDualQuat **d ) {
+  r->qx = _mm_loadu_ps( &d[0]->q.x ); r->qy = _mm_loadu_ps( &d[1]->q.x );
+  r->qz = _mm_loadu_ps( &d[2]->q.x ); r->qw = _mm_loadu_ps( &d[3]->q.x );
+  r->dx = _mm_loadu_ps( &d[0]->d.x ); r->dy = _mm_loadu_ps( &d[1]->d.x );
+  r->dz = _mm_loadu_ps( &d[2]->d.x ); r->dw = _mm_loadu_ps( &d[3]->d.x );
+  _MM_TRANSPOSE4_PS( r->qx, r->qy, r->qz, r->qw );
+  _MM_TRANSPOSE4_PS( r->dx, r->dy, r->dz, r->dw );
+}
+
+static void dual_quat4_store( GDualQuat *d, const DualQuat4 *r ) {
+  __m128 qx = r->qx, qy = r->qy, qz = r->qz, qw = r->qw;
+  __m128 dx = r->dx, dy = r->dy, dz = r->dz, dw = r->dw;
+  _MM_TRANSPOSE4_PS( qx, qy, qz, qw );
+  _MM_TRANSPOSE4_PS( dx, dy, dz, dw );
+  _mm_storeu_ps( &d[0].q.x, qx ); _mm_storeu_ps( &d[0].d.x, dx );
+  _mm_storeu_ps( &d[1].q.x, qy ); _mm_storeu_ps( &d[1].d.x, dy );
+  _mm_storeu_ps( &d[2].q.x, qz ); _mm_storeu_ps( &d[2].d.x, dz );
+  _mm_storeu_ps( &d[3].q.x, qw ); _mm_storeu_ps( &d[3].d.x, dw );
+}
+
+#define MUL_ADD( r, a, b ) r = _mm_add_ps( r, _mm_mul_ps(a, b) )
+#define MUL_SUB( r, a, b ) r = _mm_sub_ps( r, _mm_mul_ps(a, b) )
+
+// g_dual_quat_mul() in every lane
+static void dual_quat4_mul( DualQuat4 *r, const DualQuat4 *a, const DualQuat4 *b ) {
+  __m128 t;
+  t = _mm_mul_ps( a->qw, b->qw ); MUL_SUB( t, a->qx, b->qx ); MUL_SUB( t, a->qy, b->qy ); MUL_SUB( t, a->qz, b->qz ); r->qw = t;
+  t = _mm_mul_ps( a->qw, b->qx ); MUL_ADD( t, a->qx, b->qw ); MUL_ADD( t, a->qy, b->qz ); MUL_SUB( t, a->qz, b->qy ); r->qx = t;
+  t = _mm_mul_ps( a->qw, b->qy ); MUL_ADD( t, a->qy, b->qw ); MUL_SUB( t, a->qx, b->qz ); MUL_ADD( t, a->qz, b->qx ); r->qy = t;
+  t = _mm_mul_ps( a->qw, b->qz ); MUL_ADD( t, a->qz, b->qw ); MUL_ADD( t, a->qx, b->qy ); MUL_SUB( t, a->qy, b->qx ); r->qz = t;
+
+  t = _mm_mul_ps( a->dx, b->qw ); MUL_ADD( t, a->qw, b->dx ); MUL_ADD( t, a->dw, b->qx ); MUL_ADD( t, a->qx, b->dw );
+  MUL_SUB( t, a->dz, b->qy ); MUL_ADD( t, a->qy, b->dz ); MUL_ADD( t, a->dy, b->qz ); MUL_SUB( t, a->qz, b->dy ); r->dx = t;
+  t = _mm_mul_ps( a->dy, b->qw ); MUL_ADD( t, a->qw, b->dy ); MUL_ADD( t, a->dz, b->qx ); MUL_SUB( t, a->qx, b->dz );
+  MUL_ADD( t, a->dw, b->qy ); MUL_ADD( t, a->qy, b->dw ); MUL_SUB( t, a->dx, b->qz ); MUL_ADD( t, a->qz, b->dx ); r->dy = t;
+  t = _mm_mul_ps( a->dz, b->qw ); MUL_ADD( t, a->qw, b->dz ); MUL_SUB( t, a->dy, b->qx ); MUL_ADD( t, a->qx, b->dy );
+  MUL_ADD( t, a->dx, b->qy ); MUL_SUB( t, a->qy, b->dx ); MUL_ADD( t, a->dw, b->qz ); MUL_ADD( t, a->qz, b->dw ); r->dz = t;
+  t = _mm_mul_ps( a->dw, b->qw ); MUL_ADD( t, a->qw, b->dw ); MUL_SUB( t, a->qx, b->dx ); MUL_SUB( t, a->dx, b->qx );
+  MUL_SUB( t, a->qy, b->dy ); MUL_SUB( t, a->dy, b->qy ); MUL_SUB( t, a->qz, b->dz ); MUL_SUB( t, a->dz, b->qz ); r->dw = t;
+}
+
+#undef MUL_ADD
+#undef MUL_SUB
+
+// blend_joint() of the two samples of every lane, followed by the parent concatenation.
+// 'pose' keeps the joints of the group so children can read their parent in SoA form
+static void pose_group( PoseBatch *b, int group, DualQuat4 *pose ) {
+  GModel *mdl = b->mdl;
+  const __m128 zero = _mm_setzero_ps(), sign = _mm_set1_ps( -0.0f );
+  ClipSample s[4][2];
+  GModelInstance *inst[4];
+  int lane, j, lanes = b->count - 4*group < 4 ? b->count - 4*group : 4;
+
+  for( lane = 0; lane < 4; lane++ ) { // spare lanes repeat the last instance
+    int i = b->index[4*group + (lane < lanes ? lane : lanes-1)];
+    inst[lane] = b->insts[i];
+    inst[lane]->skin_valid = 0;
+    inst[lane]->last_frame = NAN;
+    inst[lane]->pose_slot = -1;
+    clip_samples( mdl, &b->layers[i], 1, s[lane] );
+    inst[lane]->frame1 = s[lane][0].frame;
+    inst[lane]->frame2 = s[lane][1].frame;
+    inst[lane]->frame_t = s[lane][1].weight;
+  }
+  __m128 w0 = _mm_setr_ps( s[0][0].weight, s[1][0].weight, s[2][0].weight, s[3][0].weight );
+  __m128 w1 = _mm_setr_ps( s[0][1].weight, s[1][1].weight, s[2][1].weight, s[3][1].weight );
+
+  for( j = 0; j < mdl->num_joints; j++ ) {
+    GDualQuat tmp[2][4], out[4], *f[2][4];
+    DualQuat4 a, c, *r = &pose[j];
+    for( lane = 0; lane < 4; lane++ ) {
+      f[0][lane] = frame_joint( mdl, s[lane][0].frame, j, &tmp[0][lane] );
+      f[1][lane] = frame_joint( mdl, s[lane][1].frame, j, &tmp[1][lane] );
+    }
+    dual_quat4_load( &a, f[0] );
+    dual_quat4_load( &c, f[1] );
+
+    // a*w0 + c*w1, with w1 flipped where c is in the other hemisphere of a*w0
+    a.qx = _mm_mul_ps( a.qx, w0 ); a.qy = _mm_mul_ps( a.qy, w0 ); a.qz = _mm_mul_ps( a.qz, w0 ); a.qw = _mm_mul_ps( a.qw, w0 );
+    a.dx = _mm_mul_ps( a.dx, w0 ); a.dy = _mm_mul_ps( a.dy, w0 ); a.dz = _mm_mul_ps( a.dz, w0 ); a.dw = _mm_mul_ps( a.dw, w0 );
+    __m128 dot = _mm_add_ps( _mm_add_ps(_mm_mul_ps(a.qx, c.qx), _mm_mul_ps(a.qy, c.qy)),
+                             _mm_add_ps(_mm_mul_ps(a.qz, c.qz), _mm_mul_ps(a.qw, c.qw)) );
+    __m128 w = _mm_xor_ps( w1, _mm_and_ps(_mm_cmplt_ps(dot, zero), sign) );
+    a.qx = _mm_add_ps( a.qx, _mm_mul_ps(c.qx, w) ); a.qy = _mm_add_ps( a.qy, _mm_mul_ps(c.qy, w) );
+    a.qz = _mm_add_ps( a.qz, _mm_mul_ps(c.qz, w) ); a.qw = _mm_add_ps( a.qw, _mm_mul_ps(c.qw, w) );
+    a.dx = _mm_add_ps( a.dx, _mm_mul_ps(c.dx, w) ); a.dy = _mm_add_ps( a.dy, _mm_mul_ps(c.dy, w) );
+    a.dz = _mm_add_ps( a.dz, _mm_mul_ps(c.dz, w) ); a.dw = _mm_add_ps( a.dw, _mm_mul_ps(c.dw, w) );
+
+    // normalize, degenerate lanes fall back to the identity like g_dual_quat_normalize
+    __m128 len = _mm_sqrt_ps( _mm_add_ps(_mm_add_ps(_mm_mul_ps(a.qx, a.qx), _mm_mul_ps(a.qy, a.qy)),
+                                         _mm_add_ps(_mm_mul_ps(a.qz, a.qz), _mm_mul_ps(a.qw, a.qw))) );
+    __m128 valid = _mm_cmpge_ps( len, _mm_set1_ps(0.00001f) );
+    __m128 inv = _mm_and_ps( _mm_div_ps(_mm_set1_ps(1.0f), len), valid );
+    a.qx = _mm_mul_ps( a.qx, inv ); a.qy = _mm_mul_ps( a.qy, inv ); a.qz = _mm_mul_ps( a.qz, inv );
+    a.qw = _mm_or_ps( _mm_mul_ps(a.qw, inv), _mm_andnot_ps(valid, _mm_set1_ps(1.0f)) );
+    a.dx = _mm_mul_ps( a.dx, inv ); a.dy = _mm_mul_ps( a.dy, inv ); a.dz = _mm_mul_ps( a.dz, inv ); a.dw = _mm_mul_ps( a.dw, inv );
+
+    if( mdl->joints[j].parent >= 0 ) dual_quat4_mul( r, &pose[mdl->joints[j].parent], &a );
+    else *r = a;
+
+    dual_quat4_store( out, r );
+    for( lane = 0; lane < lanes; lane++ ) inst[lane]->outframe[j] = out[lane];
+  }
+}
+
+static void pose_task( void *data, int first, int last ) {
+  PoseBatch *b = (PoseBatch*) data;
+  DualQuat4 *pose = (DualQuat4*) _mm_malloc( sizeof(DualQuat4) * b->mdl->num_joints, 16 );
+  for( ; first < last; first++ ) pose_group( b, first, pose );
+  _mm_free( pose );
+}
+#endif
+
+void g_model_pose_instances( GModel *mdl, GModelInstance **insts, const GAnimLayer *layers, int count ){
+  PoseBatch b = { mdl, insts, layers, g_new( int, count ), 0 };
+  int i;
+  for( i = 0; i < count; i++ ) {
+    const GAnimLayer *l = &layers[i];
+    insts[i]->culled = 0;
+    if( pose_cached( insts[i], l, 1 ) ) continue;
+#ifdef G_SSE
+    if( l->clip >= 0 && l->clip < mdl->num_anims && mdl->anims[l->clip].num_frames && l->weight > 0 && !l->additive ) {
+      b.index[b.count++] = i;
+      continue;
+    }
+#endif
+    g_model_instance_pose( insts[i], l, 1 );
+  }
+
+#ifdef G_SSE
+  if( b.count && mdl->num_joints ) {
+    int groups = (b.count + 3) / 4;
+    if( mdl->workers ) g_workers_run( mdl->workers, pose_task, &b, groups, POSE_CHUNK );
+    else pose_task( &b, 0, groups );
+  }
+#endif
+  g_free( b.index );
+}
+
+//
+// Animated bounds
+//
+// box of the frames f1 and f2 blended by t, with the sphere around its center
+static void frame_bounds( GModel *mdl, int f1, int f2, float t, GBounds *out ) {
+  if( !mdl->bounds ) {
+    *out = mdl->bind_bounds;
+    return;
+  }
+  IqmBounds *a = &mdl->bounds[f1], *b = &mdl->bounds[f2];
+  out->min.x = a->bbmin[0] + (b->bbmin[0] - a->bbmin[0])*t;
+  out->min.y = a->bbmin[1] + (b->bbmin[1] - a->bbmin[1])*t;
+  out->min.z = a->bbmin[2] + (b->bbmin[2] - a->bbmin[2])*t;
+  out->max.x = a->bbmax[0] + (b->bbmax[0] - a->bbmax[0])*t;
+  out->max.y = a->bbmax[1] + (b->bbmax[1] - a->bbmax[1])*t;
+  out->max.z = a->bbmax[2] + (b->bbmax[2] - a->bbmax[2])*t;
+  g_vec_add( &out->center, &out->min, &out->max );
+  g_vec_mul_scalar( &out->center, &out->center, 0.5f );
+  out->radius = g_vec_dist( &out->center, &out->max );
+}
+
+void g_model_bounds( GModel *mdl, float frame, GBounds *out ){
+  if( !mdl->num_frames ) {
+    *out = mdl->bind_bounds;
+    return;
+  }
+  int f1 = (int)floor(frame);
+  float t = frame - f1;
+  f1 %= mdl->num_frames;
+  if( f1 < 0 ) f1 += mdl->num_frames;
+  frame_bounds( mdl, f1, (f1 + 1) % mdl->num_frames, t, out );
+}
+
+void g_model_clip_bounds( GModel *mdl, const GAnimLayer *layer, GBounds *out ){
+  if( layer->clip < 0 || layer->clip >= mdl->num_anims || !mdl->anims[layer->clip].num_frames ) {
+    *out = mdl->bind_bounds;
+    return;
+  }
+  ClipSample s[2];
+  clip_samples( mdl, layer, 1, s );
+  frame_bounds( mdl, s[0].frame, s[1].frame, s[1].weight, out );
+}
+
+// writes the skinned positions of the instance's current pose to 'out'
+static void skin_instance( GModelInstance *inst, GVec *out ) {
+  GModel *mdl = inst->mdl;
+  SkinJob job = { mdl, inst->outframe, out };
+
+  // The actual vertex generation based on the matrixes follows...
+  // every vert only depends on outframe, so chunks can be skinned in parallel
+  // and g_workers_run() returns once all of them are done, before anything is drawn
+  if( mdl->workers ) g_workers_run( mdl->workers, skin_task, &job, mdl->num_verts, SKIN_CHUNK );
+  else skin_verts( &job, 0, mdl->num_verts );
+}
+
+//
+// Incremental skinning (G_SKIN_INCREMENTAL)
+//
+// Verts are grouped in blocks of 4 like the SIMD path. Each joint lists the blocks with a
+// vert it influences, only the influences skin_vert() reads count
+static void build_influences( GModel *mdl ) {
+  int num_blocks = (mdl->num_verts + 3) / 4, pass, b, i, k;
+  int *last = g_new( int, mdl->num_joints );
+  mdl->joint_block_ofs = g_new0( int, mdl->num_joints + 1 );
+
+  // counts first, then fills
+  for( pass = 0; pass < 2; pass++ ) {
+    for( i = 0; i < mdl->num_joints; i++ ) last[i] = -1;
+    for( b = 0; b < num_blocks; b++ )
+      for( i = 4*b; i < 4*b + 4 && i < mdl->num_verts; i++ ) {
+        IqmVertex *v = &mdl->verts[i];
+        for( k = 0; k < 4 && (!k || v->blendweight[k]); k++ ) {
+          int j = v->blendindex[k];
+          if( j >= mdl->num_joints || last[j] == b ) continue;
+          last[j] = b;
+          if( pass ) mdl->joint_blocks[mdl->joint_block_ofs[j]++] = b;
+          else mdl->joint_block_ofs[j+1]++;
+        }
       }
+    if( !pass ) {
+      for( i = 0; i < mdl->num_joints; i++ ) mdl->joint_block_ofs[i+1] += mdl->joint_block_ofs[i];
+      mdl->joint_blocks = g_new( int, mdl->joint_block_ofs[mdl->num_joints] + 1 );
     }
+  }
+  for( i = mdl->num_joints; i > 0; i-- ) mdl->joint_block_ofs[i] = mdl->joint_block_ofs[i-1]; // filling shifted them
+  mdl->joint_block_ofs[0] = 0;
+
+  mdl->dirty_blocks = g_new( int, num_blocks + 1 );
+  mdl->block_dirty = g_new0( unsigned char, num_blocks + 1 );
+  g_free( last );
+}
+
+static int joint_moved( const GDualQuat *a, const GDualQuat *b ) {
+  const float *x = &a->q.x, *y = &b->q.x;
+  int i;
+  for( i = 0; i < 8; i++ )
+    if( fabsf( x[i] - y[i] ) > SKIN_EPSILON ) return 1;
+  return 0;
+}
 
-//TODO: add a resource manager for this assets
-    GModel* g_model_load( const char *filename ){
-      char filepath[256];
-      sprintf( filepath, "data/models/%s", filename );
+typedef struct {
+  SkinJob job;
+  int *blocks;
+} BlockJob;
+
+static void skin_blocks_task( void *data, int first, int last ) {
+  BlockJob *bj = (BlockJob*) data;
+  int i, n = bj->job.mdl->num_verts;
+  for( i = first; i < last; i++ ) {
+    int v = 4*bj->blocks[i];
+    skin_verts( &bj->job, v, v + 4 < n ? v + 4 : n );
+  }
+}
+
+// Brings out_verts up to date with outframe, skinning only the blocks of the joints that
+// moved since they were skinned. Returns the number of blocks skinned, 0 if none changed
+static int skin_incremental( GModelInstance *inst ) {
+  GModel *mdl = inst->mdl;
+  int num_blocks = (mdl->num_verts + 3) / 4, num_dirty = 0, i, j;
+  if( !inst->out_verts ) inst->out_verts = g_new( GVec, mdl->num_verts );
+  if( !inst->skinned_frame ) {
+    inst->skinned_frame = g_new( GDualQuat, mdl->num_joints );
+    memcpy( inst->skinned_frame, inst->outframe, sizeof(GDualQuat)*mdl->num_joints );
+    skin_instance( inst, inst->out_verts );
+    return num_blocks;
+  }
 
-      FILE *f = fopen(filepath, "rb");
-      if(!f) return NULL;
-      GModel* mdl = g_new0( GModel, 1 );
+  for( j = 0; j < mdl->num_joints; j++ ) {
+    if( !joint_moved( &inst->skinned_frame[j], &inst->outframe[j] ) ) continue;
+    inst->skinned_frame[j] = inst->outframe[j];
+    for( i = mdl->joint_block_ofs[j]; i < mdl->joint_block_ofs[j+1]; i++ ) {
+      int b = mdl->joint_blocks[i];
+      if( !mdl->block_dirty[b] ) {
+        mdl->block_dirty[b] = 1;
+        mdl->dirty_blocks[num_dirty++] = b;
+      }
+    }
+  }
 
-      unsigned char *buf = NULL;
-      iqmheader hdr;
-      if( fread(&hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr.magic, IQM_MAGIC, sizeof(hdr.magic)) )
-        goto error;
+  for( i = 0; i < num_dirty; i++ ) mdl->block_dirty[mdl->dirty_blocks[i]] = 0;
+  if( num_dirty > num_blocks / 2 ) { // scattered blocks cost more than skinning them all in order
+    skin_instance( inst, inst->out_verts );
+    return num_dirty;
+  }
+
+  BlockJob bj = { { mdl, inst->outframe, inst->out_verts }, mdl->dirty_blocks };
+  if( mdl->workers ) g_workers_run( mdl->workers, skin_blocks_task, &bj, num_dirty, SKIN_CHUNK/4 );
+  else skin_blocks_task( &bj, 0, num_dirty );
+  return num_dirty;
+}
+
+//
+// GPU skinning, same blend as skin_vert() but done in the vertex shader
+//
+enum { ATTR_BLENDINDEX = 1, ATTR_BLENDWEIGHT = 2 }; // 0 aliases gl_Vertex
+
+#define STR( x ) #x
+#define XSTR( x ) STR( x )
+
+static const char *skin_vs =
+  "#version 120\n"
+  "uniform vec4 joints[2*" XSTR(MAX_GPU_JOINTS) "];\n" // real, dual pairs of outframe
+  "uniform vec4 pos_scale, pos_bias;\n" // dequantization of packed positions
+  "attribute vec4 blendindex;\n"
+  "attribute vec4 blendweight;\n"
+  "void main() {\n"
+  "  ivec4 j = ivec4(blendindex) * 2;\n"
+  "  vec4 q = joints[j.x] * blendweight.x, d = joints[j.x+1] * blendweight.x;\n"
+  "  for( int i = 1; i < 4; i++ ) {\n"
+  "    vec4 jq = joints[j[i]];\n"
+  "    float w = dot(q, jq) < 0.0 ? -blendweight[i] : blendweight[i];\n"
+  "    q += jq * w;\n"
+  "    d += joints[j[i]+1] * w;\n"
+  "  }\n"
+  "  float len = length(q);\n"
+  "  q /= len; d /= len;\n"
+  "  vec3 v = gl_Vertex.xyz * pos_scale.xyz + pos_bias.xyz;\n"
+  "  vec3 p = v + 2.0*cross(q.xyz, cross(q.xyz, v) + q.w*v);\n"
+  "  p += 2.0*(q.w*d.xyz - d.w*q.xyz + cross(q.xyz, d.xyz));\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+  "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "}\n";
+
+static const char *skin_fs =
+  "#version 120\n"
+  "uniform sampler2D tex;\n"
+  "void main() {\n"
+  "  gl_FragColor = gl_Color * texture2D(tex, gl_TexCoord[0].st);\n"
+  "}\n";
+
+static GLuint skin_program;
+static GLint skin_joints_loc, skin_scale_loc, skin_bias_loc;
+static int skin_program_failed;
+
+static int load_skin_program( void ) {
+  if( skin_program ) return 1;
+  if( skin_program_failed ) return 0;
+
+  const char *attribs[] = { NULL, "blendindex", "blendweight" };
+  skin_program = g_program_new( skin_vs, skin_fs, attribs, 3 );
+  if( !skin_program ) {
+    g_debug_str( "GPU skinning unavailable, using the CPU path\n" );
+    skin_program_failed = 1;
+    return 0;
+  }
+  skin_joints_loc = glGetUniformLocation( skin_program, "joints" );
+  skin_scale_loc = glGetUniformLocation( skin_program, "pos_scale" );
+  skin_bias_loc = glGetUniformLocation( skin_program, "pos_bias" );
+  glUseProgram( skin_program );
+  glUniform1i( glGetUniformLocation( skin_program, "tex" ), 0 );
+  glUseProgram( 0 );
+  return 1;
+}
+
+static void set_gpu_dequant( MeshQuant *q ) {
+  GLfloat scale[4] = { 1, 1, 1, 0 }, bias[4] = { 0, 0, 0, 0 };
+  if( q ) {
+    memcpy( scale, &q->scale, sizeof(GVec) );
+    memcpy( bias, &q->bias, sizeof(GVec) );
+  }
+  glUniform4fv( skin_scale_loc, 1, scale );
+  glUniform4fv( skin_bias_loc, 1, bias );
+}
+
+static void begin_gpu_skinning( GModelInstance *inst ) {
+  GModel *mdl = inst->mdl;
+
+  glUseProgram( skin_program );
+  glUniform4fv( skin_joints_loc, 2*mdl->num_joints, (GLfloat*) inst->outframe );
+  set_gpu_dequant( NULL );
+
+  glBindBuffer( GL_ARRAY_BUFFER, mdl->blend_vbo );
+  glVertexAttribPointer( ATTR_BLENDINDEX, 4, GL_UNSIGNED_BYTE, GL_FALSE, 8, (void*) 0 );
+  glVertexAttribPointer( ATTR_BLENDWEIGHT, 4, GL_UNSIGNED_BYTE, GL_TRUE, 8, (void*) 4 );
+  glEnableVertexAttribArray( ATTR_BLENDINDEX );
+  glEnableVertexAttribArray( ATTR_BLENDWEIGHT );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+static void end_gpu_skinning( void ) {
+  glDisableVertexAttribArray( ATTR_BLENDINDEX );
+  glDisableVertexAttribArray( ATTR_BLENDWEIGHT );
+  glUseProgram( 0 );
+}
+
+static void upload_blend_data( GModel *mdl ) {
+  unsigned char *data = g_new( unsigned char, 8*mdl->num_verts );
+  int i;
+  for( i = 0; i < mdl->num_verts; i++ ) {
+    memcpy( &data[8*i], mdl->verts[i].blendindex, 4 );
+    memcpy( &data[8*i+4], mdl->verts[i].blendweight, 4 );
+  }
+  glGenBuffers( 1, &mdl->blend_vbo );
+  glBindBuffer( GL_ARRAY_BUFFER, mdl->blend_vbo );
+  glBufferData( GL_ARRAY_BUFFER, 8*mdl->num_verts, data, GL_STATIC_DRAW );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  g_free( data );
+}
+
+// major*10 + minor of the current context
+static int gl_version( void ) {
+  const char *version = (const char*) glGetString( GL_VERSION );
+  int major = 0, minor = 0;
+  if( version ) sscanf( version, "%d.%d", &major, &minor );
+  return major*10 + minor;
+}
+
+//
+// Streaming vertex buffer
+//
+static int has_buffer_storage( void ) {
+  if( !glBufferStorage || !glFenceSync ) return 0;
+  if( gl_version() >= 44 ) return 1;
+
+  const char *ext = (const char*) glGetString( GL_EXTENSIONS );
+  return ext && strstr( ext, "GL_ARB_buffer_storage" ) != NULL;
+}
+
+static int stream_init( StreamBuffer *sb, int size ) {
+  if( !glGenBuffers || !glMapBufferRange || !glUnmapBuffer ) return 0;
+
+  sb->size = size;
+  sb->region = 0;
+  glGenBuffers( 1, &sb->vbo );
+  glBindBuffer( GL_ARRAY_BUFFER, sb->vbo );
+  if( has_buffer_storage() ) {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage( GL_ARRAY_BUFFER, STREAM_REGIONS*size, NULL, flags );
+    sb->mapped = (unsigned char*) glMapBufferRange( GL_ARRAY_BUFFER, 0, STREAM_REGIONS*size, flags );
+  }
+  if( !sb->mapped ) glBufferData( GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  return 1;
+}
+
+static void stream_destroy( StreamBuffer *sb ) {
+  int i;
+  for( i = 0; i < STREAM_REGIONS; i++ )
+    if( sb->fence[i] ) glDeleteSync( sb->fence[i] );
+  if( sb->mapped ) {
+    glBindBuffer( GL_ARRAY_BUFFER, sb->vbo );
+    glUnmapBuffer( GL_ARRAY_BUFFER );
+    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  }
+  if( sb->vbo ) glDeleteBuffers( 1, &sb->vbo );
+  memset( sb, 0, sizeof(StreamBuffer) );
+}
+
+// returns write only memory for the next 'size' bytes
+static void* stream_map( StreamBuffer *sb ) {
+  if( sb->mapped ) {
+    sb->region = (sb->region + 1) % STREAM_REGIONS;
+    if( sb->fence[sb->region] ) { // wait until the GPU is done reading this region
+      glClientWaitSync( sb->fence[sb->region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 );
+      glDeleteSync( sb->fence[sb->region] );
+      sb->fence[sb->region] = 0;
+    }
+    return sb->mapped + sb->region*sb->size;
+  }
 
-    if( hdr.version != IQM_VERSION || hdr.filesize > (16<<20) ) goto error; // sanity check... don't load files bigger than 16 MB
+  // orphan the old storage so the driver doesn't wait for draws still using it
+  glBindBuffer( GL_ARRAY_BUFFER, sb->vbo );
+  glBufferData( GL_ARRAY_BUFFER, sb->size, NULL, GL_STREAM_DRAW );
+  void *ptr = glMapBufferRange( GL_ARRAY_BUFFER, 0, sb->size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  return ptr;
+}
+
+// returns the offset of the data written since stream_map()
+static GLintptr stream_unmap( StreamBuffer *sb ) {
+  if( sb->mapped ) return sb->region*sb->size;
+
+  glBindBuffer( GL_ARRAY_BUFFER, sb->vbo );
+  glUnmapBuffer( GL_ARRAY_BUFFER );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  return 0;
+}
+
+// call once the draws reading the current region are issued
+static void stream_fence( StreamBuffer *sb ) {
+  if( !sb->mapped ) return;
+  if( sb->fence[sb->region] ) glDeleteSync( sb->fence[sb->region] ); // drawn again without a new write
+  sb->fence[sb->region] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+}
+
+//
+// Instanced drawing
+//
+// Transforms and palette rows are per instance attributes, the palettes are rows of a float
+// texture the shader skins from like skin_vs. Needs GL 3.3 for the attribute divisor
+// The transform takes 4 locations. 3 to 7 alias gl_Color, gl_SecondaryColor and gl_FogCoord on
+// compatibility profiles, 9 to 13 only alias texture units the shader does not read
+enum { ATTR_TRANSFORM = 9, ATTR_PALETTE_ROW = 13 };
 
-    buf = (unsigned char*) malloc( hdr.filesize );
-    if( fread(buf + sizeof(hdr), 1, hdr.filesize - sizeof(hdr), f) != hdr.filesize - sizeof(hdr) )
-      goto error;
+typedef struct {
+  GMat4 transform;
+  float palette_row;
+} InstanceAttribs;
+
+static const char *instanced_vs =
+  "#version 130\n"
+  "uniform sampler2D palette;\n"
+  "uniform vec4 pos_scale, pos_bias;\n"
+  "uniform bool skinned;\n"
+  "attribute vec4 blendindex;\n"
+  "attribute vec4 blendweight;\n"
+  "attribute mat4 transform;\n"
+  "attribute float palette_row;\n"
+  "vec4 joint( int j ) { return texelFetch(palette, ivec2(j, int(palette_row)), 0); }\n"
+  "void main() {\n"
+  "  vec3 p = gl_Vertex.xyz * pos_scale.xyz + pos_bias.xyz;\n"
+  "  if( skinned ) {\n"
+  "    ivec4 j = ivec4(blendindex) * 2;\n"
+  "    vec4 q = joint(j.x) * blendweight.x, d = joint(j.x+1) * blendweight.x;\n"
+  "    for( int i = 1; i < 4; i++ ) {\n"
+  "      vec4 jq = joint(j[i]);\n"
+  "      float w = dot(q, jq) < 0.0 ? -blendweight[i] : blendweight[i];\n"
+  "      q += jq * w;\n"
+  "      d += joint(j[i]+1) * w;\n"
+  "    }\n"
+  "    float len = length(q);\n"
+  "    q /= len; d /= len;\n"
+  "    vec3 v = p;\n"
+  "    p = v + 2.0*cross(q.xyz, cross(q.xyz, v) + q.w*v);\n"
+  "    p += 2.0*(q.w*d.xyz - d.w*q.xyz + cross(q.xyz, d.xyz));\n"
+  "  }\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * (transform * vec4(p, 1.0));\n"
+  "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "}\n";
+
+static GLuint instanced_program;
+static GLint instanced_scale_loc, instanced_bias_loc, instanced_skinned_loc;
+static int instanced_program_failed;
+
+static int load_instanced_program( void ) {
+  if( instanced_program ) return 1;
+  if( instanced_program_failed ) return 0;
+
+  const char *attribs[ATTR_PALETTE_ROW + 1] = { NULL, "blendindex", "blendweight" };
+  attribs[ATTR_TRANSFORM] = "transform";
+  attribs[ATTR_PALETTE_ROW] = "palette_row";
+  if( gl_version() >= 33 && glDrawElementsInstanced && glVertexAttribDivisor )
+    instanced_program = g_program_new( instanced_vs, skin_fs, attribs, ATTR_PALETTE_ROW + 1 );
+  if( !instanced_program ) {
+    g_debug_str( "instanced drawing unavailable, drawing one instance at a time\n" );
+    instanced_program_failed = 1;
+    return 0;
+  }
+  instanced_scale_loc = glGetUniformLocation( instanced_program, "pos_scale" );
+  instanced_bias_loc = glGetUniformLocation( instanced_program, "pos_bias" );
+  instanced_skinned_loc = glGetUniformLocation( instanced_program, "skinned" );
+  glUseProgram( instanced_program );
+  glUniform1i( glGetUniformLocation( instanced_program, "tex" ), 0 );
+  glUniform1i( glGetUniformLocation( instanced_program, "palette" ), 1 );
+  glUseProgram( 0 );
+  return 1;
+}
+
+static void set_instanced_dequant( MeshQuant *q ) {
+  GLfloat scale[4] = { 1, 1, 1, 0 }, bias[4] = { 0, 0, 0, 0 };
+  if( q ) {
+    memcpy( scale, &q->scale, sizeof(GVec) );
+    memcpy( bias, &q->bias, sizeof(GVec) );
+  }
+  glUniform4fv( instanced_scale_loc, 1, scale );
+  glUniform4fv( instanced_bias_loc, 1, bias );
+}
+
+// one batch of instances at the same LOD, every mesh in one draw
+static void draw_instance_batch( GModel *mdl, const GMat4 *transforms, GModelInstance **insts, const int *batch, int n, int lod ) {
+  int i, skinned = insts && mdl->palette_tex;
+
+  InstanceAttribs *attribs = (InstanceAttribs*) stream_map( &mdl->instance_stream );
+  if( !attribs ) return;
+  for( i = 0; i < n; i++ ) {
+    attribs[i].transform = transforms[batch[i]];
+    attribs[i].palette_row = (float) i;
+    if( skinned ) memcpy( &mdl->palette_data[i*mdl->num_joints], insts[batch[i]]->outframe, sizeof(GDualQuat)*mdl->num_joints );
+  }
+  GLintptr ofs = stream_unmap( &mdl->instance_stream );
 
-    if( hdr.num_meshes > 0 && !loadiqmmeshes( mdl, filename, &hdr, buf) ) goto error;
-    if( hdr.num_anims > 0 && !loadiqmanims( mdl, filename, &hdr, buf) ) goto error;
+  if( skinned ) {
+    glActiveTexture( GL_TEXTURE1 );
+    glBindTexture( GL_TEXTURE_2D, mdl->palette_tex );
+    glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, 2*mdl->num_joints, n, GL_RGBA, GL_FLOAT, mdl->palette_data );
+    glActiveTexture( GL_TEXTURE0 );
+  }
 
-    fclose(f);
-    free(buf);
-    return mdl;
+  glBindBuffer( GL_ARRAY_BUFFER, mdl->instance_stream.vbo );
+  for( i = 0; i < 4; i++ )
+    glVertexAttribPointer( ATTR_TRANSFORM + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceAttribs),
+                           (void*) (ofs + offsetof(InstanceAttribs, transform) + i*sizeof(GVec4)) );
+  glVertexAttribPointer( ATTR_PALETTE_ROW, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceAttribs), (void*) (ofs + offsetof(InstanceAttribs, palette_row)) );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+  for( i = 0; i < mdl->num_meshes; i++ ) {
+    int *range = &mdl->lod_ranges[2*(lod*mdl->num_meshes + i)];
+    set_instanced_dequant( mdl->packed ? &mdl->quant[i] : NULL );
+    glBindTexture( GL_TEXTURE_2D, mdl->textures[i] );
+    glDrawElementsInstanced( GL_TRIANGLES, 3*range[1], mdl->index_type, (GLvoid*) (GLintptr) (3*mdl->index_size*range[0]), n );
+  }
+  stream_fence( &mdl->instance_stream );
+}
+
+// 16 bit positions centered in the box
+static void quant_from_bounds( MeshQuant *q, const GVec *lo, const GVec *hi ) {
+  g_vec_add( &q->bias, (GVec*) lo, (GVec*) hi );
+  g_vec_mul_scalar( &q->bias, &q->bias, 0.5f );
+  q->scale.x = hi->x > lo->x ? (hi->x - lo->x) / 65534.0f : 1.0f;
+  q->scale.y = hi->y > lo->y ? (hi->y - lo->y) / 65534.0f : 1.0f;
+  q->scale.z = hi->z > lo->z ? (hi->z - lo->z) / 65534.0f : 1.0f;
+}
+
+// Quantize positions to the bounds of each mesh. Meshes normally own disjoint vertex
+// ranges, if any overlap they all share the bounds of the whole model instead
+static void build_mesh_quant( GModel *mdl ) {
+  int i, j, shared = 0;
+  mdl->quant = g_new( MeshQuant, mdl->num_meshes );
+
+  for( i = 0; i < mdl->num_meshes; i++ )
+    for( j = i+1; j < mdl->num_meshes; j++ ) {
+      IqmMesh *a = &mdl->meshes[i], *b = &mdl->meshes[j];
+      if( a->first_vertex < b->first_vertex + b->num_vertexes && b->first_vertex < a->first_vertex + a->num_vertexes )
+        shared = 1;
+    }
+
+  for( i = 0; i < mdl->num_meshes; i++ ) {
+    int first = shared ? 0 : mdl->meshes[i].first_vertex;
+    int last = shared ? mdl->num_verts : first + mdl->meshes[i].num_vertexes;
+    GVec lo = { 0, 0, 0 }, hi = { 0, 0, 0 };
+    if( first < last ) lo = hi = mdl->verts[first].loc;
+    for( j = first; j < last; j++ ) {
+      GVec *p = &mdl->verts[j].loc;
+      lo.x = fminf( lo.x, p->x ); hi.x = fmaxf( hi.x, p->x );
+      lo.y = fminf( lo.y, p->y ); hi.y = fmaxf( hi.y, p->y );
+      lo.z = fminf( lo.z, p->z ); hi.z = fmaxf( hi.z, p->z );
+    }
+
+    quant_from_bounds( &mdl->quant[i], &lo, &hi );
+  }
+}
+
+static short quantize( float f, float scale, float bias ) {
+  float q = floorf( (f - bias) / scale + 0.5f );
+  return (short) (q > 32767 ? 32767 : q < -32767 ? -32767 : q);
+}
+
+static void* build_packed_verts( GModel *mdl, int *size ) {
+  int i, j;
+  build_mesh_quant( mdl );
+  PackedVertex *pv = g_new0( PackedVertex, mdl->num_verts );
+
+  for( i = 0; i < mdl->num_meshes; i++ ) {
+    IqmMesh *m = &mdl->meshes[i];
+    MeshQuant *q = &mdl->quant[i];
+    for( j = m->first_vertex; j < (int) (m->first_vertex + m->num_vertexes); j++ ) {
+      IqmVertex *v = &mdl->verts[j];
+      IqmVertexAttribs *a = &mdl->attribs[j];
+      GVec4 n = { a->normal.x, a->normal.y, a->normal.z, 0 };
+      pv[j].pos[0] = quantize( v->loc.x, q->scale.x, q->bias.x );
+      pv[j].pos[1] = quantize( v->loc.y, q->scale.y, q->bias.y );
+      pv[j].pos[2] = quantize( v->loc.z, q->scale.z, q->bias.z );
+      pv[j].texcoord[0] = g_float_to_half( a->texcoord.s );
+      pv[j].texcoord[1] = g_float_to_half( a->texcoord.t );
+      pv[j].normal = g_pack_snorm10( &n );
+      pv[j].tangent = g_pack_snorm10( &a->tangent );
+    }
+  }
+
+  *size = sizeof(PackedVertex)*mdl->num_verts;
+  return pv;
+}
+
+//
+// Baked vertex animation (G_SKIN_BAKED)
+//
+// Every frame of the file is skinned once and kept quantized, drawing lerps the two frames
+// of the pose. On the GPU both are attributes of the same buffer and posing costs nothing
+// but the palette, without shaders the lerp runs on the CPU
+enum { ATTR_NEXT_POS = 1 };
+
+static const char *baked_vs =
+  "#version 120\n"
+  "uniform vec4 pos_scale, pos_bias;\n"
+  "uniform float t;\n"
+  "attribute vec4 next_pos;\n"
+  "void main() {\n"
+  "  vec3 p = mix(gl_Vertex.xyz, next_pos.xyz, t) * pos_scale.xyz + pos_bias.xyz;\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+  "  gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "}\n";
+
+static GLuint baked_program;
+static GLint baked_scale_loc, baked_bias_loc, baked_t_loc;
+static int baked_program_failed;
+
+static int load_baked_program( void ) {
+  if( baked_program ) return 1;
+  if( baked_program_failed ) return 0;
+
+  const char *attribs[] = { NULL, "next_pos" };
+  baked_program = g_program_new( baked_vs, skin_fs, attribs, 2 );
+  if( !baked_program ) {
+    g_debug_str( "GPU baked animation unavailable, lerping on the CPU\n" );
+    baked_program_failed = 1;
+    return 0;
+  }
+  baked_scale_loc = glGetUniformLocation( baked_program, "pos_scale" );
+  baked_bias_loc = glGetUniformLocation( baked_program, "pos_bias" );
+  baked_t_loc = glGetUniformLocation( baked_program, "t" );
+  glUseProgram( baked_program );
+  glUniform1i( glGetUniformLocation( baked_program, "tex" ), 0 );
+  glUseProgram( 0 );
+  return 1;
+}
+
+// skins every frame twice, for the bounds of the quantization and then to quantize them
+static void bake_frames( GModel *mdl ) {
+  GModelInstance *inst = g_model_instance_new( mdl );
+  GVec *out = g_new( GVec, mdl->num_verts ), lo = { 0, 0, 0 }, hi = { 0, 0, 0 };
+  size_t frame_size = 4 * (size_t) mdl->num_verts;
+  MeshQuant q;
+  int f, i, pass;
+  mdl->baked_verts = g_new( short, frame_size * mdl->num_frames );
+
+  for( pass = 0; pass < 2; pass++ )
+    for( f = 0; f < mdl->num_frames; f++ ) {
+      animate_joints( mdl, inst->outframe, f );
+      skin_instance( inst, out );
+      if( !pass ) {
+        if( !f && mdl->num_verts ) lo = hi = out[0];
+        for( i = 0; i < mdl->num_verts; i++ ) {
+          lo.x = fminf( lo.x, out[i].x ); hi.x = fmaxf( hi.x, out[i].x );
+          lo.y = fminf( lo.y, out[i].y ); hi.y = fmaxf( hi.y, out[i].y );
+          lo.z = fminf( lo.z, out[i].z ); hi.z = fmaxf( hi.z, out[i].z );
+        }
+        continue;
+      }
+      if( !f ) quant_from_bounds( &q, &lo, &hi );
+      short *dst = &mdl->baked_verts[frame_size * f];
+      for( i = 0; i < mdl->num_verts; i++ ) {
+        dst[4*i+0] = quantize( out[i].x, q.scale.x, q.bias.x );
+        dst[4*i+1] = quantize( out[i].y, q.scale.y, q.bias.y );
+        dst[4*i+2] = quantize( out[i].z, q.scale.z, q.bias.z );
+        dst[4*i+3] = 0;
+      }
+    }
+  mdl->baked_quant = q;
+  g_free( out );
+  g_model_instance_destroy( inst );
+
+  if( mdl->vbo && load_baked_program() ) {
+    glGenBuffers( 1, &mdl->baked_vbo );
+    glBindBuffer( GL_ARRAY_BUFFER, mdl->baked_vbo );
+    glBufferData( GL_ARRAY_BUFFER, sizeof(short) * frame_size * mdl->num_frames, mdl->baked_verts, GL_STATIC_DRAW );
+    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+    g_free( mdl->baked_verts );
+    mdl->baked_verts = NULL;
+  }
+}
+
+static void lerp_baked( GModelInstance *inst, GVec *out ) {
+  GModel *mdl = inst->mdl;
+  size_t frame_size = 4 * (size_t) mdl->num_verts;
+  const short *a = &mdl->baked_verts[frame_size * inst->frame1], *b = &mdl->baked_verts[frame_size * inst->frame2];
+  const GVec *scale = &mdl->baked_quant.scale, *bias = &mdl->baked_quant.bias;
+  float t = inst->frame_t;
+  int i;
+  for( i = 0; i < mdl->num_verts; i++, a += 4, b += 4 ) {
+    out[i].x = (a[0] + (b[0] - a[0]) * t) * scale->x + bias->x;
+    out[i].y = (a[1] + (b[1] - a[1]) * t) * scale->y + bias->y;
+    out[i].z = (a[2] + (b[2] - a[2]) * t) * scale->z + bias->z;
+  }
+}
+
+// replaces the position of the static buffer with the two frames, after it was set
+static void begin_baked_lerp( GModelInstance *inst ) {
+  GModel *mdl = inst->mdl;
+  GLintptr frame_size = 4 * sizeof(short) * mdl->num_verts;
+  GLfloat scale[4] = { 1, 1, 1, 0 }, bias[4] = { 0, 0, 0, 0 };
+  memcpy( scale, &mdl->baked_quant.scale, sizeof(GVec) );
+  memcpy( bias, &mdl->baked_quant.bias, sizeof(GVec) );
+
+  glUseProgram( baked_program );
+  glUniform4fv( baked_scale_loc, 1, scale );
+  glUniform4fv( baked_bias_loc, 1, bias );
+  glUniform1f( baked_t_loc, inst->frame_t );
+
+  glBindBuffer( GL_ARRAY_BUFFER, mdl->baked_vbo );
+  glVertexPointer( 3, GL_SHORT, 4*sizeof(short), (void*) (frame_size * inst->frame1) );
+  glVertexAttribPointer( ATTR_NEXT_POS, 3, GL_SHORT, GL_FALSE, 4*sizeof(short), (void*) (frame_size * inst->frame2) );
+  glEnableVertexAttribArray( ATTR_NEXT_POS );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+static void end_baked_lerp( void ) {
+  glDisableVertexAttribArray( ATTR_NEXT_POS );
+  glUseProgram( 0 );
+}
+
+static void* build_float_verts( GModel *mdl, int *size ) {
+  int i, pos_size = sizeof(GVec)*mdl->num_verts;
+  *size = pos_size + sizeof(GVec2)*mdl->num_verts;
+  unsigned char *data = g_new( unsigned char, *size );
+  GVec *pos = (GVec*) data;
+  GVec2 *tc = (GVec2*) (data + pos_size);
+  for( i = 0; i < mdl->num_verts; i++ ) {
+    pos[i] = mdl->verts[i].loc;
+    tc[i] = mdl->attribs[i].texcoord;
+  }
+  return data;
+}
+
+// half float vertex attributes are core since GL 3.0, asks GL so it runs on the GL thread
+static int packed_layout( int flags ) {
+  return (flags & GM_PACKED_VERTS) && glGenBuffers && gl_version() >= 30;
+}
+
+// frees what the loader allocated, the rest points into the mapping
+static void free_owned( GModel *mdl, void *p ) {
+  if( p && ((unsigned char*) p < mdl->map || (unsigned char*) p >= mdl->map + mdl->map_size) ) g_free( p );
+}
+
+// Vertex and index data as the GPU gets it, also what the baked cache stores
+typedef struct {
+  void *verts, *indices;
+  int verts_size, indices_size;
+} StaticData;
+
+static void build_static_data( GModel *mdl, StaticData *sd ) {
+  memset( sd, 0, sizeof(StaticData) );
+  if( !mdl->num_verts ) return;
+
+  sd->verts = mdl->packed ? build_packed_verts( mdl, &sd->verts_size ) : build_float_verts( mdl, &sd->verts_size );
+
+  // the file's triangles followed by the LODs, optimized models get 16 bit
+  // indexes when every vertex can be addressed with them
+  int i, n = 3*(mdl->num_tris + mdl->num_lod_tris);
+  int short_index = mdl->optimized && mdl->num_verts <= 65536;
+  mdl->index_type = short_index ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+  mdl->index_size = short_index ? sizeof(GLushort) : sizeof(GLuint);
+  sd->indices_size = mdl->index_size*n;
+  sd->indices = g_new( unsigned char, sd->indices_size );
+  for( i = 0; i < n; i++ ) {
+    unsigned int v = i < 3*mdl->num_tris ? ((unsigned int*) mdl->tris)[i] : ((unsigned int*) mdl->lod_tris)[i - 3*mdl->num_tris];
+    if( short_index ) ((GLushort*) sd->indices)[i] = (GLushort) v;
+    else ((GLuint*) sd->indices)[i] = v;
+  }
+}
+
+// Static geometry lives on the GPU, only the CPU skinned positions are sent every frame
+static void upload_static_buffers( GModel *mdl, const StaticData *sd ) {
+  if( !glGenBuffers || !sd->verts_size ) return;
+
+  glGenBuffers( 1, &mdl->vbo );
+  glBindBuffer( GL_ARRAY_BUFFER, mdl->vbo );
+  glBufferData( GL_ARRAY_BUFFER, sd->verts_size, sd->verts, GL_STATIC_DRAW );
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+  glGenBuffers( 1, &mdl->ibo );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mdl->ibo );
+  glBufferData( GL_ELEMENT_ARRAY_BUFFER, sd->indices_size, sd->indices, GL_STATIC_DRAW );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+}
+
+static void free_static_data( GModel *mdl, StaticData *sd ) {
+  free_owned( mdl, sd->verts );
+  free_owned( mdl, sd->indices );
+  sd->verts = sd->indices = NULL;
+}
+
+static void set_material( GModel *mdl, const char *filename, int i, GLuint tex ) {
+  IqmMesh *m = &mdl->meshes[i];
+  g_debug_str("%s: loaded mesh: %s\n", filename, &mdl->text[m->name]);
+
+  mdl->textures[i] = tex;
+  if( tex ) g_debug_str("%s: loaded material: %s\n", filename, &mdl->text[m->material]);
+  else g_debug_str("%s: couldn't load material: %s\n", filename, &mdl->text[m->material]);
+}
+
+static void load_materials( GModel *mdl, const char *filename ) {
+  int i;
+  mdl->textures = g_new0( GLuint, mdl->num_meshes );
+  if( mdl->assets ) mdl->shared = g_new0( GTexture*, mdl->num_meshes );
+  for( i = 0; i < mdl->num_meshes; i++ ) {
+    const char *material = &mdl->text[mdl->meshes[i].material];
+    if( mdl->assets ) {
+      mdl->shared[i] = g_assets_texture( mdl->assets, material );
+      set_material( mdl, filename, i, mdl->shared[i] ? mdl->shared[i]->id : 0 );
+      continue;
+    }
+
+    GImage img;
+    GTexture tex;
+    g_image_load( &img, material );
+    set_material( mdl, filename, i, g_texture_create( &tex, &img ) );
+    g_image_free( &img );
+  }
+}
+
+//
+// Baked cache (GM_CACHE)
+//
+// Everything the iqm loader derives, ready to use from a single mapping: the GPU vertex and
+// index data, the final frames (or the compressed channels), LODs, bounds and names.
+// It is stamped with the source's size and time, when those change the source is hashed
+// and the cache rebuilt only if the contents changed too
+#define BAKED_MAGIC "MYRBAKE"
+#define BAKED_VERSION 3 // bump with any change to the layout or to what the loader derives
+
+enum {
+  BAKED_TEXT, BAKED_MESHES, BAKED_VERTS, BAKED_ATTRIBS, BAKED_TRIS, BAKED_LOD_TRIS, BAKED_LOD_RANGES,
+  BAKED_JOINTS, BAKED_POSES, BAKED_ANIMS, BAKED_BOUNDS, BAKED_FRAMES, BAKED_ANIM_DATA, BAKED_CHANNELS,
+  BAKED_BASE, BAKED_INVERSEBASE, BAKED_QUANT, BAKED_BVH_NODES, BAKED_BVH_BLOCKS,
+  NUM_BAKED_FIELDS,
+  BAKED_VBO = NUM_BAKED_FIELDS, BAKED_IBO,
+  NUM_BAKED
+};
+
+// the GModel pointer each section is mapped to
+static const size_t baked_fields[NUM_BAKED_FIELDS] = {
+  offsetof(GModel, text), offsetof(GModel, meshes), offsetof(GModel, verts), offsetof(GModel, attribs),
+  offsetof(GModel, tris), offsetof(GModel, lod_tris), offsetof(GModel, lod_ranges), offsetof(GModel, joints),
+  offsetof(GModel, poses), offsetof(GModel, anims), offsetof(GModel, bounds), offsetof(GModel, frames),
+  offsetof(GModel, anim_data), offsetof(GModel, channels), offsetof(GModel, base), offsetof(GModel, inversebase),
+  offsetof(GModel, quant), offsetof(GModel, bvh_nodes), offsetof(GModel, bvh_blocks)
+};
+
+typedef struct {
+  char magic[8];
+  unsigned int version, flags, source_hash;
+  unsigned long long source_size, source_time;
+  int num_meshes, num_verts, num_tris, num_joints, num_frames, num_anims, num_text, num_lod_tris, num_lods;
+  int num_bvh_nodes, num_bvh_blocks;
+  int packed, index_type, index_size;
+  GBounds bind_bounds;
+  unsigned int ofs[NUM_BAKED], size[NUM_BAKED]; // 16 byte aligned
+} BakedHeader;
+
+#define BAKED_FIELD( mdl, i ) (*(void**) ((unsigned char*) (mdl) + baked_fields[i]))
+
+// size of every field section for the counts in 'mdl', 0 for the fields it doesn't have
+static void baked_sizes( GModel *mdl, unsigned int *size ) {
+  size_t n[NUM_BAKED_FIELDS] = {
+    mdl->num_text, sizeof(IqmMesh)*mdl->num_meshes, sizeof(IqmVertex)*mdl->num_verts,
+    sizeof(IqmVertexAttribs)*mdl->num_verts, sizeof(IqmTriangle)*mdl->num_tris, sizeof(IqmTriangle)*mdl->num_lod_tris,
+    sizeof(int)*2*mdl->num_lods*mdl->num_meshes, sizeof(IqmJoint)*mdl->num_joints, sizeof(IqmPose)*mdl->num_joints,
+    sizeof(IqmAnim)*mdl->num_anims, sizeof(IqmBounds)*mdl->num_frames, sizeof(GDualQuat)*mdl->num_frames*mdl->num_joints,
+    sizeof(unsigned short)*8*mdl->num_frames*mdl->num_joints, sizeof(AnimChannels)*mdl->num_joints,
+    sizeof(GDualQuat)*mdl->num_joints, sizeof(GDualQuat)*mdl->num_joints, sizeof(MeshQuant)*mdl->num_meshes,
+    sizeof(BvhNode)*mdl->num_bvh_nodes, sizeof(TriBlock)*mdl->num_bvh_blocks
+  };
+  int i;
+  for( i = 0; i < NUM_BAKED_FIELDS; i++ ) size[i] = BAKED_FIELD( mdl, i ) ? (unsigned int) n[i] : 0;
+}
+
+static void baked_path( char *path, const char *filename ) {
+  sprintf( path, "data/models/%s.baked", filename );
+}
+
+// a touched source that still hashes the same gets its new time, so the next load skips the hash
+static void restamp_baked( const char *path, unsigned long long source_time ) {
+  FILE *f = fopen( path, "r+b" );
+  if( !f ) return;
+  fseek( f, offsetof(BakedHeader, source_time), SEEK_SET );
+  fwrite( &source_time, sizeof(source_time), 1, f );
+  fclose( f );
+}
+
+static GModel* load_baked( const char *filename, int flags, int packed, StaticData *sd ) {
+  char path[256], srcpath[256];
+  baked_path( path, filename );
+  sprintf( srcpath, "data/models/%s", filename );
+
+  size_t size;
+  unsigned char *buf;
+  int restamped = 0;
+map:
+  buf = (unsigned char*) g_file_map( path, &size );
+  if( !buf ) return NULL;
+
+  BakedHeader *h = (BakedHeader*) buf;
+  if( size < sizeof(BakedHeader) || memcmp( h->magic, BAKED_MAGIC, sizeof(h->magic) ) ||
+      h->version != BAKED_VERSION || h->flags != (unsigned int) flags )
+    goto stale;
+
+  // a cache without its source is used as it is
+  unsigned long long source_size, source_time;
+  if( g_file_stamp( srcpath, &source_size, &source_time ) &&
+      (source_size != h->source_size || source_time != h->source_time) ) {
+    size_t src_size;
+    void *src = g_file_map( srcpath, &src_size );
+    unsigned int hash = src ? fnv1a( 2166136261u, src, src_size ) : 0;
+    g_file_unmap( src, src_size );
+    if( !src || src_size != h->source_size || hash != h->source_hash ) goto stale;
+    if( !restamped ) { // windows can't write to a file while it is mapped
+      g_file_unmap( buf, size );
+      restamp_baked( path, source_time );
+      restamped = 1;
+      goto map;
+    }
+  }
+
+  // packing depends on the GL version, a cache from another one doesn't fit
+  if( h->packed != packed ) goto stale;
+
+  int i;
+  for( i = 0; i < NUM_BAKED; i++ )
+    if( h->ofs[i] > size || h->size[i] > size - h->ofs[i] ) goto stale;
+
+  GModel *mdl = g_new0( GModel, 1 );
+  mdl->flags = flags;
+  mdl->map = buf;
+  mdl->map_size = size;
+  mdl->num_meshes = h->num_meshes; mdl->num_verts = h->num_verts; mdl->num_tris = h->num_tris;
+  mdl->num_joints = h->num_joints; mdl->num_frames = h->num_frames; mdl->num_anims = h->num_anims;
+  mdl->num_text = h->num_text; mdl->num_lod_tris = h->num_lod_tris; mdl->num_lods = h->num_lods;
+  mdl->num_bvh_nodes = h->num_bvh_nodes; mdl->num_bvh_blocks = h->num_bvh_blocks;
+  mdl->packed = h->packed;
+  mdl->index_type = h->index_type;
+  mdl->index_size = h->index_size;
+  mdl->bind_bounds = h->bind_bounds;
+  for( i = 0; i < NUM_BAKED_FIELDS; i++ )
+    BAKED_FIELD( mdl, i ) = h->size[i] ? buf + h->ofs[i] : NULL;
+
+  unsigned int expected[NUM_BAKED_FIELDS];
+  baked_sizes( mdl, expected );
+  if( memcmp( expected, h->size, sizeof(expected) ) || (mdl->num_text && mdl->text[mdl->num_text-1]) ) {
+    g_model_destroy( mdl ); // unmaps buf
+    g_debug_str( "%s: baked cache is corrupt, rebuilding\n", filename );
+    return NULL;
+  }
+  if( !mdl->text ) mdl->text = "";
+
+#ifdef G_SSE
+  if( mdl->num_anims ) build_skin_blocks( mdl );
+#endif
+  sd->verts = buf + h->ofs[BAKED_VBO];
+  sd->indices = buf + h->ofs[BAKED_IBO];
+  sd->verts_size = h->size[BAKED_VBO];
+  sd->indices_size = h->size[BAKED_IBO];
+  return mdl;
+
+stale:
+  g_file_unmap( buf, size );
+  g_debug_str( "%s: baked cache is stale, rebuilding\n", filename );
+  return NULL;
+}
+
+// Written to a temporary first so a crash never leaves a truncated cache behind. Loads of the
+// same file on several workers each get their own, named after their static data, and the last rename wins
+static void write_baked( GModel *mdl, const char *filename, const void *src, size_t src_size, const StaticData *sd ) {
+  char path[256], tmppath[256], srcpath[256];
+  baked_path( path, filename );
+  sprintf( tmppath, "data/models/%s.baked.%lx.tmp", filename, (unsigned long) (size_t) sd );
+  sprintf( srcpath, "data/models/%s", filename );
+
+  BakedHeader h;
+  memset( &h, 0, sizeof(h) );
+  memcpy( h.magic, BAKED_MAGIC, sizeof(BAKED_MAGIC) );
+  h.version = BAKED_VERSION;
+  h.flags = mdl->flags;
+  h.source_hash = fnv1a( 2166136261u, src, src_size );
+  if( !g_file_stamp( srcpath, &h.source_size, &h.source_time ) ) return;
+  h.num_meshes = mdl->num_meshes; h.num_verts = mdl->num_verts; h.num_tris = mdl->num_tris;
+  h.num_joints = mdl->num_joints; h.num_frames = mdl->num_frames; h.num_anims = mdl->num_anims;
+  h.num_text = mdl->num_text; h.num_lod_tris = mdl->num_lod_tris; h.num_lods = mdl->num_lods;
+  h.num_bvh_nodes = mdl->num_bvh_nodes; h.num_bvh_blocks = mdl->num_bvh_blocks;
+  h.packed = mdl->packed;
+  h.index_type = mdl->index_type;
+  h.index_size = mdl->index_size;
+  h.bind_bounds = mdl->bind_bounds;
+
+  const void *data[NUM_BAKED];
+  int i;
+  baked_sizes( mdl, h.size );
+  for( i = 0; i < NUM_BAKED_FIELDS; i++ ) data[i] = BAKED_FIELD( mdl, i );
+  data[BAKED_VBO] = sd->verts; h.size[BAKED_VBO] = sd->verts_size;
+  data[BAKED_IBO] = sd->indices; h.size[BAKED_IBO] = sd->indices_size;
+
+  unsigned int ofs = (sizeof(h) + 15) & ~15;
+  for( i = 0; i < NUM_BAKED; i++ ) {
+    h.ofs[i] = ofs;
+    ofs = (ofs + h.size[i] + 15) & ~15;
+  }
 
-    error:
-    g_fatal_error("%s: error while loading\n", filename);
-    free( buf );
-    g_model_destroy( mdl );
-    fclose(f);
+  FILE *f = fopen( tmppath, "wb" );
+  if( !f ) {
+    g_debug_str( "%s: couldn't write the baked cache\n", filename );
+    return;
+  }
+  static const unsigned char pad[16];
+  int ok = fwrite( &h, sizeof(h), 1, f ) == 1;
+  for( i = 0; i < NUM_BAKED && ok; i++ ) {
+    long at = ftell( f );
+    ok = fwrite( pad, 1, h.ofs[i] - at, f ) == h.ofs[i] - at &&
+         (!h.size[i] || fwrite( data[i], h.size[i], 1, f ) == 1);
+  }
+  if( fclose( f ) || !ok ) {
+    remove( tmppath );
+    g_debug_str( "%s: couldn't write the baked cache\n", filename );
+    return;
+  }
+  remove( path ); // rename() doesn't replace on windows
+  if( rename( tmppath, path ) ) g_debug_str( "%s: couldn't write the baked cache\n", filename );
+  else g_debug_str( "%s: wrote baked cache, %u bytes\n", filename, ofs );
+}
+
+GModel* g_model_load( const char *filename ){
+  return g_model_load_ex( filename, 0 );
+}
+
+// Everything but the GL objects, so it can run on any thread. 'corrupt' tells a file
+// that failed to load apart from a missing one
+static GModel* model_read( const char *filename, int flags, int packed, StaticData *sd, int *corrupt ) {
+  char filepath[256];
+  sprintf( filepath, "data/models/%s", filename );
+  *corrupt = 0;
+
+  // a hit is the only mapping, the source is only read when its stamp changed
+  GModel* mdl;
+  if( (flags & GM_CACHE) && (mdl = load_baked( filename, flags, packed, sd )) ) return mdl;
+
+  size_t size;
+  unsigned char *buf = (unsigned char*) g_file_map( filepath, &size );
+  if( !buf ) return NULL;
+
+  // the mapping lives as long as the model, parts of it are used in place
+  mdl = g_new0( GModel, 1 );
+  mdl->flags = flags;
+  mdl->packed = packed;
+  mdl->map = buf;
+  mdl->map_size = size;
+
+  iqmheader hdr;
+  if( size < sizeof(hdr) ) goto error;
+  memcpy( &hdr, buf, sizeof(hdr) );
+  if( memcmp(hdr.magic, IQM_MAGIC, sizeof(hdr.magic)) || hdr.version != IQM_VERSION || hdr.filesize > size )
+    goto error;
+
+  if( hdr.ofs_text && !iqm_in_file( &hdr, hdr.ofs_text, hdr.num_text, 1 ) ) goto error;
+  mdl->text = hdr.ofs_text ? (char *)&buf[hdr.ofs_text] : "";
+  mdl->num_text = hdr.ofs_text ? hdr.num_text : 0;
+  if( mdl->num_text && mdl->text[mdl->num_text-1] ) goto error; // names must stay in the table
+
+  if( hdr.num_meshes > 0 && !loadiqmmeshes( mdl, filename, &hdr, buf) ) goto error;
+  if( hdr.num_anims > 0 && !loadiqmanims( mdl, filename, &hdr, buf) ) goto error;
+
+  if( flags & GM_COLLISION ) build_bvh( mdl, filename );
+  build_static_data( mdl, sd );
+  if( flags & GM_CACHE ) write_baked( mdl, filename, buf, size, sd );
+  return mdl;
+
+error:
+  *corrupt = 1;
+  g_model_destroy( mdl );
+  return NULL;
+}
+
+GModel* g_model_load_shared( GAssets* assets, const char *filename, int flags ){
+  StaticData sd;
+  int corrupt;
+  GModel *mdl = model_read( filename, flags, packed_layout( flags ), &sd, &corrupt );
+  if( !mdl ) {
+    if( corrupt ) g_fatal_error("%s: error while loading\n", filename);
     return NULL;
   }
 
+  upload_static_buffers( mdl, &sd );
+  free_static_data( mdl, &sd );
+  mdl->assets = assets;
+  load_materials( mdl, filename );
+  return mdl;
+}
+
+GModel* g_model_load_ex( const char *filename, int flags ){
+  return g_model_load_shared( NULL, filename, flags );
+}
+
+//
+// Asynchronous loading
+//
+typedef struct {
+  char filename[256];
+  int flags, packed;
+  GModel *mdl;
+  StaticData sd;
+  GImage *images; // materials, decoded on the worker
+  int step;       // GL steps done, the buffers first and then one texture per mesh
+} ModelLoad;
+
+static int model_load_work( void *job ) {
+  ModelLoad *l = (ModelLoad*) job;
+  int i, corrupt;
+  l->mdl = model_read( l->filename, l->flags, l->packed, &l->sd, &corrupt );
+  if( !l->mdl ) {
+    if( corrupt ) g_debug_str("%s: error while loading\n", l->filename);
+    return 0;
+  }
+
+  l->images = g_new0( GImage, l->mdl->num_meshes > 0 ? l->mdl->num_meshes : 1 );
+  for( i = 0; i < l->mdl->num_meshes; i++ )
+    g_image_load( &l->images[i], &l->mdl->text[l->mdl->meshes[i].material] );
+  return 1;
+}
+
+static int model_load_upload( void *job ) {
+  ModelLoad *l = (ModelLoad*) job;
+  GModel *mdl = l->mdl;
+  if( !l->step ) {
+    upload_static_buffers( mdl, &l->sd );
+    free_static_data( mdl, &l->sd );
+    mdl->textures = g_new0( GLuint, mdl->num_meshes );
+  } else {
+    GTexture tex;
+    set_material( mdl, l->filename, l->step-1, g_texture_create( &tex, &l->images[l->step-1] ) );
+    g_image_free( &l->images[l->step-1] );
+  }
+  return ++l->step > mdl->num_meshes;
+}
+
+static void* model_load_finish( void *job, int ok ) {
+  ModelLoad *l = (ModelLoad*) job;
+  GModel *mdl = l->mdl;
+  int i;
+  if( mdl ) {
+    free_static_data( mdl, &l->sd );
+    for( i = 0; i < mdl->num_meshes; i++ ) g_image_free( &l->images[i] );
+    g_free( l->images );
+    if( !ok ) {
+      g_model_destroy( mdl );
+      mdl = NULL;
+    }
+  }
+  g_free( l );
+  return mdl;
+}
+
+static const GLoadType model_load = { model_load_work, model_load_upload, model_load_finish };
+
+GLoad* g_model_load_async( GLoader* loader, const char *filename, int flags, GLoadFunc done, void *data ){
+  ModelLoad *l = g_new0( ModelLoad, 1 );
+  snprintf( l->filename, sizeof(l->filename), "%s", filename );
+  l->flags = flags;
+  l->packed = packed_layout( flags );
+  return g_loader_add( loader, &model_load, l, done, data );
+}
+
+static void instance_free( GModelInstance *inst ) {
+  if( inst->outframe ) g_free( inst->outframe );
+  if( inst->skinned_frame ) g_free( inst->skinned_frame );
+  if( inst->out_verts ) g_free( inst->out_verts );
+  stream_destroy( &inst->stream );
+  g_free( inst );
+}
+
   void g_model_destroy( GModel *mdl ){
     if( !mdl ) return;
-    if( mdl->str ) g_free( mdl->str );
-    if( mdl->meshes ) g_free( mdl->meshes );
-    if( mdl->tris ) g_free( mdl->tris );
-    if( mdl->verts ) g_free( mdl->verts );
-    if( mdl->out_verts ) g_free( mdl->out_verts );
-    if( mdl->joints ) g_free( mdl->joints );
-    if( mdl->frames ) g_free( mdl->frames );
-    if( mdl->outframe ) g_free( mdl->outframe );
+    if( mdl->instance ) g_model_instance_destroy( mdl->instance );
+    free_pose_cache( mdl );
+    if( mdl->num_instances ) g_debug_str( "g_model_destroy: %d instances still alive\n", mdl->num_instances );
+    while( mdl->free_instances ) {
+      GModelInstance *next = mdl->free_instances->next_free;
+      instance_free( mdl->free_instances );
+      mdl->free_instances = next;
+    }
 
+    free_owned( mdl, mdl->verts );
+    free_owned( mdl, mdl->attribs );
+    free_owned( mdl, mdl->frames );
+    free_owned( mdl, mdl->anim_data );
+    free_owned( mdl, mdl->channels );
+    free_owned( mdl, mdl->base );
+    free_owned( mdl, mdl->inversebase );
+    if( mdl->joint_blocks ) g_free( mdl->joint_blocks );
+    if( mdl->joint_block_ofs ) g_free( mdl->joint_block_ofs );
+    if( mdl->dirty_blocks ) g_free( mdl->dirty_blocks );
+    if( mdl->block_dirty ) g_free( mdl->block_dirty );
+#ifdef G_SSE
+    if( mdl->skin_blocks ) _mm_free( mdl->skin_blocks );
+#endif
+
+    if( mdl->blend_vbo ) glDeleteBuffers( 1, &mdl->blend_vbo );
+    if( mdl->baked_vbo ) glDeleteBuffers( 1, &mdl->baked_vbo );
+    if( mdl->instance_stream.vbo ) stream_destroy( &mdl->instance_stream );
+    if( mdl->palette_tex ) glDeleteTextures( 1, &mdl->palette_tex );
+    if( mdl->palette_data ) g_free( mdl->palette_data );
+    if( mdl->baked_verts ) g_free( mdl->baked_verts );
+    if( mdl->vbo ) glDeleteBuffers( 1, &mdl->vbo );
+    if( mdl->ibo ) glDeleteBuffers( 1, &mdl->ibo );
+
+    if( mdl->shared ) {
+      int i;
+      for( i = 0; i < mdl->num_meshes; i++ )
+        if( mdl->shared[i] ) g_assets_release( mdl->assets, mdl->shared[i] );
+      g_free( mdl->shared );
+    }
     if( mdl->textures ) g_free( mdl->textures );
+    free_owned( mdl, mdl->quant );
+    free_owned( mdl, mdl->meshes ); // copies after GM_OPTIMIZE
+    free_owned( mdl, mdl->tris );
+    free_owned( mdl, mdl->lod_tris );
+    free_owned( mdl, mdl->lod_ranges );
+    free_owned( mdl, mdl->bvh_nodes );
+    free_owned( mdl, mdl->bvh_blocks );
+    if( mdl->map ) g_file_unmap( mdl->map, mdl->map_size );
     g_free( mdl );
   }
 
+  void g_model_set_workers( GModel *mdl, GWorkers *workers ){
+    if( mdl ) mdl->workers = workers;
+  }
+
+  int g_model_set_skinning( GModel *mdl, int mode ){
+    if( mode == G_SKIN_GPU ) {
+      if( !mdl->num_frames || mdl->num_joints > MAX_GPU_JOINTS || !glGenBuffers || !load_skin_program() )
+        mode = G_SKIN_CPU;
+      else if( !mdl->blend_vbo )
+        upload_blend_data( mdl );
+    }
+    if( mode == G_SKIN_INCREMENTAL && !mdl->joint_block_ofs ) build_influences( mdl );
+    if( mode == G_SKIN_BAKED ) {
+      if( !mdl->num_frames ) mode = G_SKIN_CPU;
+      else if( !mdl->baked_verts && !mdl->baked_vbo ) bake_frames( mdl );
+    }
+    mdl->skinning = mode;
+    return mode;
+  }
+
+// Instances come from the model's pool, a reused one keeps its palette, skinned
+// positions and stream buffer, so creating one per frame costs nothing after the first
+GModelInstance* g_model_instance_new( GModel *mdl ){
+  int i;
+  GModelInstance *inst = mdl->free_instances;
+  if( inst ) mdl->free_instances = inst->next_free;
+  else {
+    inst = g_new0( GModelInstance, 1 );
+    inst->mdl = mdl;
+    inst->outframe = g_new( GDualQuat, mdl->num_joints ? mdl->num_joints : 1 );
+  }
+  inst->next_free = NULL;
+  inst->skin_valid = inst->culled = 0;
+  inst->last_frame = NAN;
+  inst->pose_slot = -1;
+  inst->frame1 = -1;
+  inst->lod_frame = 0;
+  inst->lod = 0;
+  inst->position = (GVec){ 0, 0, 0 };
+  inst->lod_phase = mdl->instance_serial++;
+  for( i = 0; i < mdl->num_joints; i++ ) // starts in the bind pose
+    inst->outframe[i] = (GDualQuat){{.0, .0, .0, 1.0}, {.0, .0, .0, .0}};
+  mdl->num_instances++;
+  return inst;
+}
+
+void g_model_instance_destroy( GModelInstance *inst ){
+  if( !inst ) return;
+  GModel *mdl = inst->mdl;
+  inst->next_free = mdl->free_instances;
+  mdl->free_instances = inst;
+  mdl->num_instances--;
+}
+
+void g_model_instance_set_frame( GModelInstance *inst, float frame ){
+  inst->culled = 0;
+  if( inst->mdl->num_frames && frame != inst->last_frame ) { // the same frame is still posed and skinned
+    animate_joints( inst->mdl, inst->outframe, frame );
+    inst->skin_valid = 0;
+    inst->last_frame = frame;
+    inst->pose_slot = -1;
+    inst->frame1 = (int) floor( frame );
+    inst->frame_t = frame - inst->frame1;
+    inst->frame1 %= inst->mdl->num_frames;
+    if( inst->frame1 < 0 ) inst->frame1 += inst->mdl->num_frames;
+    inst->frame2 = (inst->frame1 + 1) % inst->mdl->num_frames;
+  }
+}
+
+  void g_model_instance_draw( GModelInstance *inst, float frame ){
+    g_model_instance_set_frame( inst, frame );
+    g_model_instance_draw_posed( inst );
+  }
+
 //TODO: add support for normals and normal mapping
-  void g_model_draw( GModel *mdl, float frame ){
-    animateiqm( mdl, frame );
+  void g_model_instance_draw_posed( GModelInstance *inst ){
+    GModel *mdl = inst->mdl;
+    if( inst->culled ) return; // outside the frustum at the last g_anim_lod_update() and not posed since
+
+    int gpu = mdl->skinning == G_SKIN_GPU;
+    int baked = mdl->skinning == G_SKIN_BAKED && inst->frame1 >= 0; // the others are skinned from the palette
+    int lerp_gpu = baked && mdl->baked_vbo;
+    int skinned = mdl->num_frames > 0 && !gpu && !lerp_gpu;
+
+    // a cached pose is skinned once in its slot, until the slot holds another one
+    if( skinned && inst->pose_slot >= 0 ) {
+      PoseSlot *slot = inst->pose_slot < mdl->pose_slots ? &mdl->pose_cache[inst->pose_slot] : NULL;
+      if( slot && slot->serial == inst->pose_serial ) {
+        if( slot->inst->skin_valid ) mdl->pose_stats.skin_hits++;
+        slot->inst->lod = inst->lod;
+        g_model_instance_draw_posed( slot->inst );
+        return;
+      }
+      inst->pose_slot = -1;
+    }
 
-    IqmVertex* v = (mdl->num_frames > 0 ? mdl->out_verts : mdl->verts);
-    glVertexPointer(3, GL_FLOAT, sizeof(IqmVertex), &v[0].loc );
+    // skinned positions are per instance, streamed when there is a vbo to draw the rest from.
+    // They are kept until the instance is posed again, so throttled instances draw them as they are
+    if( skinned && mdl->vbo && !inst->stream.vbo ) stream_init( &inst->stream, sizeof(GVec)*mdl->num_verts );
+    if( skinned && !inst->skin_valid && mdl->skinning == G_SKIN_INCREMENTAL ) {
+      // the stream can't be updated in place, out_verts is and gets copied when anything changed
+      if( skin_incremental( inst ) ) {
+        GVec *mapped = inst->stream.vbo ? (GVec*) stream_map( &inst->stream ) : NULL;
+        if( mapped ) {
+          memcpy( mapped, inst->out_verts, sizeof(GVec)*mdl->num_verts );
+          inst->stream_ofs = stream_unmap( &inst->stream );
+        }
+        inst->streamed = mapped != NULL;
+      }
+      inst->skin_valid = 1;
+    }
+    if( skinned && !inst->skin_valid ) {
+      if( inst->skinned_frame ) { // out_verts won't follow the pose anymore
+        g_free( inst->skinned_frame );
+        inst->skinned_frame = NULL;
+      }
+      // skin straight into the mapped GPU memory when there is any
+      GVec *mapped = inst->stream.vbo ? (GVec*) stream_map( &inst->stream ) : NULL;
+      if( !mapped && !inst->out_verts ) inst->out_verts = g_new( GVec, mdl->num_verts );
+      if( baked ) lerp_baked( inst, mapped ? mapped : inst->out_verts );
+      else skin_instance( inst, mapped ? mapped : inst->out_verts );
+      if( mapped ) inst->stream_ofs = stream_unmap( &inst->stream );
+      inst->streamed = mapped != NULL;
+      inst->skin_valid = 1;
+    }
+    int stream = skinned && inst->streamed;
+
+    if( gpu ) begin_gpu_skinning( inst );
+
+    if( mdl->vbo ) {
+      glBindBuffer( GL_ARRAY_BUFFER, mdl->vbo );
+      if( mdl->packed ) {
+        if( !skinned ) glVertexPointer( 3, GL_SHORT, sizeof(PackedVertex), (void*) offsetof(PackedVertex, pos) );
+        glTexCoordPointer( 2, GL_HALF_FLOAT, sizeof(PackedVertex), (void*) offsetof(PackedVertex, texcoord) );
+      } else {
+        if( !skinned ) glVertexPointer( 3, GL_FLOAT, sizeof(GVec), (void*) 0 );
+        glTexCoordPointer( 2, GL_FLOAT, sizeof(GVec2), (void*) (sizeof(GVec)*mdl->num_verts) );
+      }
+      if( stream ) {
+        glBindBuffer( GL_ARRAY_BUFFER, inst->stream.vbo );
+        glVertexPointer( 3, GL_FLOAT, sizeof(GVec), (void*) inst->stream_ofs );
+      }
+      glBindBuffer( GL_ARRAY_BUFFER, 0 );
+      if( skinned && !stream ) glVertexPointer( 3, GL_FLOAT, sizeof(GVec), inst->out_verts );
+      if( lerp_gpu ) begin_baked_lerp( inst );
+    } else {
+      if( skinned ) glVertexPointer( 3, GL_FLOAT, sizeof(GVec), inst->out_verts );
+      else glVertexPointer( 3, GL_FLOAT, sizeof(IqmVertex), &mdl->verts[0].loc );
+      glTexCoordPointer( 2, GL_FLOAT, sizeof(IqmVertexAttribs), &mdl->attribs[0].texcoord );
+    }
 
 //    glNormalPointer(GL_FLOAT, 0, numframes > 0 ? outnormal : innormal);
-    glTexCoordPointer(2, GL_FLOAT, sizeof(IqmVertex), &mdl->verts[0].texcoord );
 
     glEnableClientState( GL_VERTEX_ARRAY );
 //    glEnableClientState(GL_NORMAL_ARRAY);
     glEnableClientState( GL_TEXTURE_COORD_ARRAY );
 
-    int i;
+    if( mdl->ibo ) glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mdl->ibo );
+
+    // packed positions are mesh relative, scale them back with the shader or the modelview matrix
+    int dequant = mdl->packed && !skinned && !lerp_gpu;
+
+    int i, lod = inst->lod < mdl->num_lods ? inst->lod : mdl->num_lods - 1;
     for( i = 0; i < mdl->num_meshes; i++ ) {
-      IqmMesh *m = &mdl->meshes[i];
+      int *range = &mdl->lod_ranges[2*(lod*mdl->num_meshes + i)];
+      MeshQuant *q = dequant ? &mdl->quant[i] : NULL;
+      if( q && gpu ) set_gpu_dequant( q );
+      else if( q ) {
+        glPushMatrix();
+        glTranslatef( q->bias.x, q->bias.y, q->bias.z );
+        glScalef( q->scale.x, q->scale.y, q->scale.z );
+      }
+
+      // with an ibo bound the index pointer is an offset into it
+      const GLvoid *first = mdl->ibo ? (GLvoid*) (GLintptr) (3*mdl->index_size*range[0]) :
+                            range[0] < mdl->num_tris ? &mdl->tris[range[0]] : &mdl->lod_tris[range[0] - mdl->num_tris];
       glBindTexture( GL_TEXTURE_2D, mdl->textures[i] );
-      glDrawElements( GL_TRIANGLES, 3*m->num_triangles, GL_UNSIGNED_INT, &mdl->tris[m->first_triangle] );
+      glDrawElements( GL_TRIANGLES, 3*range[1], mdl->ibo ? mdl->index_type : GL_UNSIGNED_INT, first );
+
+      if( q && !gpu ) glPopMatrix();
     }
 
+    if( mdl->ibo ) glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+    if( stream ) stream_fence( &inst->stream );
+
     glDisableClientState(GL_VERTEX_ARRAY);
 //    glDisableClientState(GL_NORMAL_ARRAY);
     glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    if( gpu ) end_gpu_skinning();
+    if( lerp_gpu ) end_baked_lerp();
+  }
+
+void g_model_instance_set_position( GModelInstance *inst, GVec *pos ){
+  inst->position = *pos;
+}
+
+int g_model_num_joints( GModel *mdl ){
+  return mdl->num_joints;
+}
+
+int g_model_find_joint( GModel *mdl, const char *name ){
+  int i;
+  for( i = 0; i < mdl->num_joints; i++ )
+    if( !strcmp( &mdl->text[mdl->joints[i].name], name ) ) return i;
+  return -1;
+}
+
+// the palette is relative to the bind pose, the base pose puts the joint back in model space
+// model space is moved to the instance position, the same placement the LOD culls with
+void g_model_instance_joint( GModelInstance *inst, int joint, GDualQuat *out ){
+  GQuat identity = { 0, 0, 0, 1 };
+  GDualQuat place;
+  g_dual_quat_mul( out, &inst->outframe[joint], &inst->mdl->base[joint] );
+  g_dual_quat_normalize( out );
+  g_dual_quat_from_quat_vec( &place, &identity, &inst->position );
+  g_dual_quat_mul( out, &place, out );
+}
+
+int g_model_instance_find_joint( GModelInstance *inst, const char *name, GDualQuat *out ){
+  int joint = g_model_find_joint( inst->mdl, name );
+  if( joint >= 0 ) g_model_instance_joint( inst, joint, out );
+  return joint;
+}
+
+void g_model_instance_set_lod( GModelInstance *inst, int lod ){
+  inst->lod = lod < 0 ? 0 : lod;
+}
+
+int g_model_num_lods( GModel *mdl ){
+  return mdl->num_lods;
+}
+
+// Each level halves the triangles, so it is picked every time the projected radius
+// drops by sqrt(2), which halves the screen area and keeps the triangle density even
+int g_model_select_lod( GModel *mdl, GCamera *cam, GVec *center, float radius ){
+  float w = cam->proj.v[2].w < 0 ? g_vec_dist( &cam->eye, center ) : 1; // perspective divide
+  float size = radius * cam->proj.v[1].y / (w > 0.0001f ? w : 0.0001f);
+  if( size >= LOD_SCREEN_SIZE ) return 0;
+
+  int lod = 1 + (int) (2 * log2f( LOD_SCREEN_SIZE / size ));
+  return lod < mdl->num_lods ? lod : mdl->num_lods - 1;
+}
+
+//
+// Animation LOD
+//
+void g_anim_lod_create( GAnimLod *lod, float near_dist, float far_dist, int max_interval ){
+  memset( lod, 0, sizeof(GAnimLod) );
+  lod->near_dist = near_dist;
+  lod->far_dist = far_dist > near_dist ? far_dist : near_dist;
+  lod->max_interval = max_interval > 1 ? max_interval : 1;
+}
+
+// frames between pose updates at distance 'd'
+static int lod_interval( GAnimLod *lod, float d ) {
+  if( d <= lod->near_dist ) return 1;
+  if( d >= lod->far_dist ) return lod->max_interval;
+  return 1 + (int) ((d - lod->near_dist) / (lod->far_dist - lod->near_dist) * (lod->max_interval - 1));
+}
+
+// Visible instances that are due are posed with g_model_pose_instances(), one batch per
+// run of instances of the same model. The phase spreads the throttled ones over the frames
+void g_anim_lod_update( GAnimLod *lod, GCamera *cam, GModelInstance **insts, const GAnimLayer *layers, int count ){
+  GModelInstance **batch = g_new( GModelInstance*, count );
+  GAnimLayer *batch_layers = g_new( GAnimLayer, count );
+  int i, n = 0;
+
+  lod->frame++;
+  lod->updated = lod->throttled = lod->culled = 0;
+  for( i = 0; i < count; i++ ) {
+    GModelInstance *inst = insts[i];
+    GModel *mdl = inst->mdl;
+    GBounds bounds;
+    GVec center;
+    g_model_clip_bounds( mdl, &layers[i], &bounds );
+    g_vec_add( &center, &inst->position, &bounds.center );
+
+    if( cam->build_frustum && g_camera_frustum_test( cam, &center, bounds.radius ) == G_OUTSIDE ) {
+      inst->culled = 1;
+      lod->culled++;
+      continue;
+    }
+
+    // new instances and the ones coming back on screen are posed right away
+    int interval = lod_interval( lod, g_vec_dist( &cam->eye, &center ) );
+    if( inst->lod_frame && !inst->culled && (lod->frame + inst->lod_phase) % interval ) {
+      lod->throttled++;
+      continue;
+    }
+    inst->culled = 0;
+    inst->lod_frame = lod->frame;
+    inst->lod = g_model_select_lod( mdl, cam, &center, bounds.radius );
+    lod->updated++;
+
+    if( n && batch[0]->mdl != mdl ) {
+      g_model_pose_instances( batch[0]->mdl, batch, batch_layers, n );
+      n = 0;
+    }
+    batch[n] = inst;
+    batch_layers[n++] = layers[i];
+  }
+  if( n ) g_model_pose_instances( batch[0]->mdl, batch, batch_layers, n );
+
+  g_free( batch );
+  g_free( batch_layers );
+}
+
+  void g_model_draw( GModel *mdl, float frame ){
+    if( !mdl->instance ) mdl->instance = g_model_instance_new( mdl );
+    g_model_instance_draw( mdl->instance, frame );
   }
 
+// Instances are grouped by LOD and drawn INSTANCE_BATCH at a time, skinned on the GPU from
+// their last pose whatever the skinning mode. Without GL 3.3 each one is drawn on its own
+void g_model_draw_instanced( GModel *mdl, const GMat4 *transforms, GModelInstance **insts, int count ){
+  int i, lod;
+  if( count <= 0 ) return;
+  if( !insts || !mdl->num_frames ) insts = NULL; // the bind pose is the static buffer
+
+  if( !mdl->vbo || !mdl->ibo || !load_instanced_program() ) {
+    GModelInstance *bind = insts ? NULL : g_model_instance_new( mdl );
+    for( i = 0; i < count; i++ ) {
+      glPushMatrix();
+      glMultMatrixf( (const GLfloat*) &transforms[i] );
+      g_model_instance_draw_posed( insts ? insts[i] : bind );
+      glPopMatrix();
+    }
+    g_model_instance_destroy( bind );
+    return;
+  }
+
+  if( !mdl->instance_stream.vbo && !stream_init( &mdl->instance_stream, INSTANCE_BATCH*sizeof(InstanceAttribs) ) ) return;
+  if( insts && !mdl->blend_vbo ) upload_blend_data( mdl );
+  if( insts && !mdl->palette_tex ) {
+    mdl->palette_data = g_new( GDualQuat, INSTANCE_BATCH*mdl->num_joints );
+    glGenTextures( 1, &mdl->palette_tex );
+    glBindTexture( GL_TEXTURE_2D, mdl->palette_tex );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA32F, 2*mdl->num_joints, INSTANCE_BATCH, 0, GL_RGBA, GL_FLOAT, NULL );
+    glBindTexture( GL_TEXTURE_2D, 0 );
+  }
+
+  glUseProgram( instanced_program );
+  glUniform1i( instanced_skinned_loc, insts != NULL );
+
+  glBindBuffer( GL_ARRAY_BUFFER, mdl->vbo );
+  if( mdl->packed ) {
+    glVertexPointer( 3, GL_SHORT, sizeof(PackedVertex), (void*) offsetof(PackedVertex, pos) );
+    glTexCoordPointer( 2, GL_HALF_FLOAT, sizeof(PackedVertex), (void*) offsetof(PackedVertex, texcoord) );
+  } else {
+    glVertexPointer( 3, GL_FLOAT, sizeof(GVec), (void*) 0 );
+    glTexCoordPointer( 2, GL_FLOAT, sizeof(GVec2), (void*) (sizeof(GVec)*mdl->num_verts) );
+  }
+  if( insts ) {
+    glBindBuffer( GL_ARRAY_BUFFER, mdl->blend_vbo );
+    glVertexAttribPointer( ATTR_BLENDINDEX, 4, GL_UNSIGNED_BYTE, GL_FALSE, 8, (void*) 0 );
+    glVertexAttribPointer( ATTR_BLENDWEIGHT, 4, GL_UNSIGNED_BYTE, GL_TRUE, 8, (void*) 4 );
+    glEnableVertexAttribArray( ATTR_BLENDINDEX );
+    glEnableVertexAttribArray( ATTR_BLENDWEIGHT );
+  }
+  glBindBuffer( GL_ARRAY_BUFFER, 0 );
+  for( i = 0; i < 5; i++ ) {
+    glEnableVertexAttribArray( ATTR_TRANSFORM + i ); // ATTR_PALETTE_ROW follows the transform
+    glVertexAttribDivisor( ATTR_TRANSFORM + i, 1 );
+  }
+  glEnableClientState( GL_VERTEX_ARRAY );
+  glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mdl->ibo );
+
+  // culled instances are skipped like g_model_instance_draw_posed() does
+  int batch[INSTANCE_BATCH], n = 0;
+  for( lod = 0; lod < mdl->num_lods; lod++ ) {
+    for( i = 0; i < count; i++ ) {
+      GModelInstance *inst = insts ? insts[i] : NULL;
+      int l = !inst ? 0 : inst->lod < mdl->num_lods ? inst->lod : mdl->num_lods - 1;
+      if( l != lod || (inst && inst->culled) ) continue;
+      batch[n++] = i;
+      if( n == INSTANCE_BATCH ) {
+        draw_instance_batch( mdl, transforms, insts, batch, n, lod );
+        n = 0;
+      }
+    }
+    if( n ) draw_instance_batch( mdl, transforms, insts, batch, n, lod );
+    n = 0;
+  }
+
+  glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+  glDisableClientState( GL_VERTEX_ARRAY );
+  glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+  for( i = 0; i < 5; i++ ) {
+    glVertexAttribDivisor( ATTR_TRANSFORM + i, 0 );
+    glDisableVertexAttribArray( ATTR_TRANSFORM + i );
+  }
+  if( insts ) {
+    glDisableVertexAttribArray( ATTR_BLENDINDEX );
+    glDisableVertexAttribArray( ATTR_BLENDWEIGHT );
+  }
+  glUseProgram( 0 );
+}
+
+// Nearest hit first: the closer child is visited first and boxes behind the best hit are skipped
+int g_model_raycast( GModel *mdl, const GVec *origin, const GVec *dir, float max_t, GRayHit *hit ){
+  int stack[BVH_MAX_DEPTH], top = 0, i;
+  if( !mdl->bvh_nodes ) return 0;
+
+  Ray r = { *origin, *dir, { 1 / dir->x, 1 / dir->y, 1 / dir->z } };
+  GRayHit best = { max_t, 0, 0, -1, -1 };
+  stack[top++] = 0;
+  while( top ) {
+    const BvhNode *n = &mdl->bvh_nodes[stack[--top]];
+    if( ray_box( &r, n, best.t ) == FLT_MAX ) continue;
+    if( n->count ) {
+      for( i = 0; i < n->count; i++ ) ray_block( &r, &mdl->bvh_blocks[n->first + i], &best );
+      continue;
+    }
+    int a = (int) (n - mdl->bvh_nodes) + 1, b = n->first;
+    float ta = ray_box( &r, &mdl->bvh_nodes[a], best.t ), tb = ray_box( &r, &mdl->bvh_nodes[b], best.t );
+    if( ta > tb ) {
+      int t = a; a = b; b = t;
+      float f = ta; ta = tb; tb = f;
+    }
+    if( tb != FLT_MAX ) stack[top++] = b;
+    if( ta != FLT_MAX ) stack[top++] = a;
+  }
+  if( best.tri < 0 ) return 0;
 
+  for( i = 0; i < mdl->num_meshes; i++ )
+    if( (unsigned int) best.tri - mdl->meshes[i].first_triangle < mdl->meshes[i].num_triangles ) best.mesh = i;
+  *hit = best;
+  return 1;
+}
@@ -8,6 +8,13 @@
 #include <GL/gl.h>
 
 #include "gl/glext.h"
+
+#ifndef GL_VERSION_4_4 // the bundled glext.h predates GL 4.4
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC) (GLenum target, GLsizeiptr size, const GLvoid *data, GLbitfield flags);
+#endif
+
 #include "gl_extensions.h"
 
 
@@ -30,6 +37,16 @@
 
 #define g_free( pointer ) free( pointer )
 
+// SIMD kernels are used when the compiler targets SSE, define G_NO_SIMD to force the scalar paths
+#if !defined(G_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define G_SSE 1
+#include <xmmintrin.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define G_SSE2 1 // integer conversions
+#include <emmintrin.h>
+#endif
+#endif
+
 // ===============================================================
 // Math (math.c)
 // ===============================================================
@@ -89,6 +106,11 @@ void g_dual_quat_from_quat_vec( GDualQuat* r, GQuat* q, GVec* v );
 void g_dual_quat_scale_add( GDualQuat* r, GDualQuat* dq, float s );
 void g_dual_quat_lerp( GDualQuat* r, GDualQuat* d1, GDualQuat* d2, float t );
 
+// Packing for compact vertex formats
+unsigned short g_float_to_half( float f );
+float g_half_to_float( unsigned short h );
+unsigned int g_pack_snorm10( GVec4 *v ); // xyz in 10 bits each, w in 2 bits, matches GL_INT_2_10_10_10_REV
+
 
 // ===============================================================
 // Camera and Culling (camera.c)
@@ -119,13 +141,113 @@ int g_camera_frustum_test( GCamera* cam, GVec* pt, float radius );
 // ===============================================================
 typedef struct _GModel GModel;
 
+enum { // g_model_load_ex() flags
+    GM_PACKED_VERTS = 1,  // 16 bit positions, half float texcoords, 10:10:10:2 normals and tangents on the GPU
+    GM_COMPRESS_ANIMS = 2, // keep the 16 bit iqm frame channels and decode the joints when they are sampled
+    GM_OPTIMIZE = 4,       // weld verts, reorder triangles and verts for the vertex cache, 16 bit indexes when possible
+    GM_BUILD_LODS = 8,     // simplified versions of every mesh, selected per instance
+    GM_CACHE = 16,         // load from a baked copy next to the file, written on the first load and when the file changes
+    GM_COLLISION = 32      // build a BVH of the triangles for g_model_raycast()
+};
+
 GModel* g_model_load( const char* filename );
+GModel* g_model_load_ex( const char* filename, int flags );
 void g_model_destroy( GModel* mdl );
 void g_model_draw( GModel* mdl, float frame );
 
+typedef struct {
+    GVec min, max;
+    GVec center; float radius; // sphere around the box, for g_camera_frustum_test()
+} GBounds;
+void g_model_bounds( GModel* mdl, float frame, GBounds* out ); // bind pose bounds if the file has none
+
+typedef struct _GWorkers GWorkers;
+void g_model_set_workers( GModel* mdl, GWorkers* workers ); // skin on a worker pool, NULL to skin on the calling thread
+
+// Incremental is CPU skinning of the verts whose joints moved. Baked skins every frame once when it is
+// set and lerps the two frames of single clip poses, on the GPU when there are shaders, blends are skinned
+enum { G_SKIN_CPU, G_SKIN_GPU, G_SKIN_INCREMENTAL, G_SKIN_BAKED };
+int g_model_set_skinning( GModel* mdl, int mode ); // returns the mode in use, GPU falls back to CPU without shaders
+
+// An instance shares all the data of its model and only owns a pose and the skinned positions.
+// Destroyed instances go back to a pool in the model, all of them must be destroyed before it
+typedef struct _GModelInstance GModelInstance;
+GModelInstance* g_model_instance_new( GModel* mdl );
+void g_model_instance_destroy( GModelInstance* inst );
+void g_model_instance_draw( GModelInstance* inst, float frame ); // poses the instance at a frame of the whole file, then draws it
+void g_model_instance_set_frame( GModelInstance* inst, float frame ); // only poses it, vertices are skinned when it is drawn
+
+// Clips are the iqm anims, layers blend them by weight and additive ones are applied on top
+typedef struct {
+    int clip;
+    float time;     // seconds, wraps around in looping clips
+    float weight;
+    int additive;   // adds the difference to the first frame of the clip
+} GAnimLayer;
+
+int g_model_find_clip( GModel* mdl, const char* name ); // -1 if there is none
+int g_model_num_clips( GModel* mdl );
+float g_model_clip_duration( GModel* mdl, int clip );   // seconds, 0 for an invalid clip
+void g_model_instance_pose( GModelInstance* inst, const GAnimLayer* layers, int num_layers );
+void g_model_clip_bounds( GModel* mdl, const GAnimLayer* layer, GBounds* out );
+void g_model_instance_draw_posed( GModelInstance* inst ); // draws the last pose
+// g_model_instance_pose( insts[i], &layers[i], 1 ) for instances of the same model, several at a time
+void g_model_pose_instances( GModel* mdl, GModelInstance** insts, const GAnimLayer* layers, int count );
+// Draws 'count' copies with one draw per mesh, each placed by its transform (column major, like
+// glMultMatrixf()) in the last pose of its instance, or in the bind pose when 'insts' is NULL
+void g_model_draw_instanced( GModel* mdl, const GMat4* transforms, GModelInstance** insts, int count );
+
+// Pose cache, instances posed with a single regular layer share the pose of their clip at the
+// time rounded to 'step' seconds, and when skinned on the CPU its skinned positions too.
+// 'slots' poses are kept, 0 turns it off. The stats count since it was last set
+typedef struct {
+    unsigned int hits, misses;  // poses found in the cache or evaluated into it
+    unsigned int skin_hits;     // draws of a cached pose that was already skinned
+    float hit_rate;
+} GPoseCacheStats;
+
+void g_model_set_pose_cache( GModel* mdl, int slots, float step );
+void g_model_pose_cache_stats( GModel* mdl, GPoseCacheStats* stats );
+
+// Animation LOD, poses instances less often the further they are from the camera and
+// not at all when the bounds of their clip are outside its frustum. Culled instances are not drawn until they
+// are posed again, throttled ones redraw their last pose
+typedef struct {
+    float near_dist, far_dist; // posed every frame up to near_dist, every max_interval frames from far_dist
+    int max_interval;
+    unsigned int frame;
+    int updated, throttled, culled; // instances in each case at the last update
+} GAnimLod;
+
+void g_anim_lod_create( GAnimLod* lod, float near_dist, float far_dist, int max_interval );
+void g_anim_lod_update( GAnimLod* lod, GCamera* cam, GModelInstance** insts, const GAnimLayer* layers, int count );
+void g_model_instance_set_position( GModelInstance* inst, GVec* pos ); // where the LOD places the model's bounds and the joints are
+
+// Mesh LODs, 0 is the full mesh. g_anim_lod_update() also picks the level of the instances it poses
+int g_model_num_lods( GModel* mdl );
+int g_model_select_lod( GModel* mdl, GCamera* cam, GVec* center, float radius ); // from the projected size of the sphere
+void g_model_instance_set_lod( GModelInstance* inst, int lod );
+
+// Ray casts against the bind pose of a GM_COLLISION model, in model space. Both faces are hit,
+// the model is only read so rays can be cast from several threads at once
+typedef struct {
+    float t;       // along the ray, in units of 'dir'
+    float u, v;    // barycentrics, hit = (1-u-v)*v0 + u*v1 + v*v2
+    int tri, mesh; // in the file's triangles (reordered by GM_OPTIMIZE)
+} GRayHit;
+
+int g_model_raycast( GModel* mdl, const GVec* origin, const GVec* dir, float max_t, GRayHit* hit ); // 1 and the nearest hit under max_t
+
+// Joints of the last pose in world space, which is model space moved to g_model_instance_set_position(),
+// for attachments. Posing never touches the vertices, instances that are only queried cost the joint palette and nothing else
+int g_model_num_joints( GModel* mdl );
+int g_model_find_joint( GModel* mdl, const char* name ); // -1 if there is none
+void g_model_instance_joint( GModelInstance* inst, int joint, GDualQuat* out ); // g_dual_quat_vec_mul() places points with it
+int g_model_instance_find_joint( GModelInstance* inst, const char* name, GDualQuat* out ); // the joint, -1 and out untouched if there is none
+
 
 // ===============================================================
-// Texture and Font loading (assets.c)
+// Texture, Font and Shader loading (assets.c)
 // ===============================================================
 typedef struct {
     GLuint id, bpp;
@@ -136,9 +258,68 @@ typedef struct _GFont GFont;
 int g_texture_load( GTexture *t, const char *filename );
 // destroy with glDeleteTex()
 
+// the decoding half of g_texture_load(), it doesn't touch GL so any thread can run it
+typedef struct {
+    unsigned char *pixels;
+    int width, height, bpp;
+} GImage;
+int g_image_load( GImage *img, const char *filename );
+void g_image_free( GImage *img );
+int g_texture_create( GTexture *t, GImage *img );
+
 GFont* g_font_new (char *filename);
 void g_font_render( GFont *fnt, char *str );
-// destroy with g_free();
+void g_font_destroy( GFont *fnt );
+
+// attribs[i] gets bound to location i, returns 0 if shaders are unsupported or fail to build
+GLuint g_program_new( const char *vs, const char *fs, const char **attribs, int num_attribs );
+// destroy with glDeleteProgram()
+
+// Asynchronous loading. Files are read, parsed and decoded on the workers (right away without
+// them), the GL objects are made in g_loader_update(), called on the GL thread every frame
+typedef struct _GLoader GLoader;
+typedef struct _GLoad GLoad;
+typedef void (*GLoadFunc)( GLoad* load, void *data ); // from g_loader_update() once it is ready or failed
+
+enum { G_LOAD_PENDING, G_LOAD_READY, G_LOAD_FAILED };
+
+GLoader* g_loader_new( GWorkers* workers );
+void g_loader_destroy( GLoader* loader ); // waits for the loads in flight, those not yet freed turn G_LOAD_FAILED without 'done' and still need g_load_free()
+int g_loader_update( GLoader* loader, float budget_ms ); // returns how many loads are pending
+
+GLoad* g_texture_load_async( GLoader* loader, const char *filename, GLoadFunc done, void *data ); // a GTexture*
+GLoad* g_model_load_async( GLoader* loader, const char *filename, int flags, GLoadFunc done, void *data ); // a GModel*
+int g_load_state( GLoad* load );
+void* g_load_asset( GLoad* load ); // once ready, the caller owns it from then on
+void g_load_free( GLoad* load );   // a pending load is dropped when it finishes
+
+// New kinds of asset: 'work' runs on a worker, 'upload' on the GL thread a step at a time until
+// it returns 1, then 'finish' frees the job and returns the asset, or frees everything if !ok
+typedef struct {
+    int (*work)( void *job );
+    int (*upload)( void *job );
+    void* (*finish)( void *job, int ok );
+} GLoadType;
+GLoad* g_loader_add( GLoader* loader, const GLoadType* type, void *job, GLoadFunc done, void *data );
+
+// Asset cache, textures, fonts and models are loaded once per name (and flags for models) and
+// shared. Every get takes a reference, the asset is freed when the last one is released
+typedef struct _GAssets GAssets;
+typedef struct {
+    int hits, misses;             // gets that found the asset loaded or had to load it
+    int textures, fonts, models;  // loaded now
+    size_t texture_bytes;
+} GAssetStats;
+
+GAssets* g_assets_new( void );
+void g_assets_destroy( GAssets* a ); // frees what is still referenced
+GTexture* g_assets_texture( GAssets* a, const char *filename );
+GFont* g_assets_font( GAssets* a, const char *filename );
+GModel* g_assets_model( GAssets* a, const char *filename, int flags );
+void g_assets_release( GAssets* a, void *asset );
+void g_assets_stats( GAssets* a, GAssetStats* stats );
+
+GModel* g_model_load_shared( GAssets* a, const char *filename, int flags ); // materials from the cache, models aren't cached
 
 // ===============================================================
 // System (sys_*.c)
@@ -215,5 +396,27 @@ void g_fatal_error( const char* str, ... );
 #define g_check_condition(A, B) if (!(A)) { g_fatal_error(B); }
 #define g_check_wcondition(A, B) if (!(A)) { g_fatal_werror(B); }
 
+// Read only view of a whole file, NULL if it can't be opened
+void* g_file_map( const char *filename, size_t *size );
+void g_file_unmap( void *data, size_t size );
+int g_file_stamp( const char *filename, unsigned long long *size, unsigned long long *mtime ); // 0 if it doesn't exist
+
+// Persistent worker pool, g_workers_run() splits [0, count) in chunks of 'chunk' items,
+// runs them on the workers and on the calling thread, and returns when all of them are done
+typedef void (*GTaskFunc)( void *data, int first, int last );
+
+GWorkers* g_workers_new( int num_threads ); // num_threads <= 0 uses one per extra cpu core
+void g_workers_run( GWorkers* w, GTaskFunc fn, void *data, int count, int chunk );
+void g_workers_destroy( GWorkers* w ); // runs the background jobs still queued first
+int g_cpu_count( void );
+
+// Background jobs, fn( data, 0, 1 ) runs on a worker while the caller carries on, batches
+// from g_workers_run() go first. Without threads it runs right away in g_workers_submit()
+typedef struct _GJob GJob;
+GJob* g_workers_submit( GWorkers* w, GTaskFunc fn, void *data );
+int g_workers_poll( GWorkers* w, GJob* job, int wait ); // 1 once it finished, the job is freed then
+
+double g_time( void ); // seconds since an arbitrary point, for measuring intervals
+
 
 #endif // MYR_H_INCLUDED
@@ -0,0 +1,173 @@
+// Self check for the GM_COLLISION BVH, run with 'make check'.
+// Casts rays at synthetic meshes with g_model_raycast() and against every triangle, and
+// through a closed sphere, where hits on the edges count too. Exits with 1 when the BVH
+// misses a hit or finds a different distance
+#include "model.c"
+
+#define NUM_RAYS 20000
+#define TOLERANCE 1e-4f
+#define EDGE 1e-3  // hits this close to an edge may go to either triangle or none in floats, those rays aren't compared
+
+static float frand( float lo, float hi ) {
+    return lo + (hi - lo) * (rand() / (float) RAND_MAX);
+}
+
+// closed sphere around the origin, two meshes so the mesh lookup is checked too
+static void make_sphere( GModel *mdl, IqmMesh *meshes, int rings, int segments ) {
+    int r, s, n = 0;
+    mdl->num_verts = (rings + 1) * segments;
+    mdl->num_tris = 2 * rings * segments;
+    mdl->verts = g_new0( IqmVertex, mdl->num_verts );
+    mdl->tris = g_new( IqmTriangle, mdl->num_tris );
+    for( r = 0; r <= rings; r++ )
+        for( s = 0; s < segments; s++ ) {
+            float a = 3.14159265f * r / rings, b = 2 * 3.14159265f * s / segments;
+            GVec *p = &mdl->verts[r*segments + s].loc;
+            p->x = sinf( a ) * cosf( b ); p->y = sinf( a ) * sinf( b ); p->z = cosf( a );
+        }
+    for( r = 0; r < rings; r++ )
+        for( s = 0; s < segments; s++ ) {
+            unsigned int v0 = r*segments + s, v1 = r*segments + (s+1) % segments;
+            unsigned int v2 = v0 + segments, v3 = v1 + segments;
+            IqmTriangle t0 = {{ v0, v2, v1 }}, t1 = {{ v1, v2, v3 }};
+            mdl->tris[n++] = t0;
+            mdl->tris[n++] = t1;
+        }
+    mdl->num_meshes = 2;
+    mdl->meshes = meshes;
+    memset( meshes, 0, 2 * sizeof(IqmMesh) );
+    meshes[0].num_triangles = meshes[1].first_triangle = n / 2;
+    meshes[1].num_triangles = n - n / 2;
+}
+
+// overlapping random triangles, the worst case for the SAH
+static void make_soup( GModel *mdl, IqmMesh *meshes, int num_tris ) {
+    int i;
+    mdl->num_verts = 3 * num_tris;
+    mdl->num_tris = num_tris;
+    mdl->verts = g_new0( IqmVertex, mdl->num_verts );
+    mdl->tris = g_new( IqmTriangle, mdl->num_tris );
+    for( i = 0; i < mdl->num_verts; i++ ) {
+        GVec *p = &mdl->verts[i].loc;
+        p->x = frand(-1, 1); p->y = frand(-1, 1); p->z = frand(-1, 1);
+    }
+    for( i = 0; i < num_tris; i++ ) {
+        IqmTriangle t = {{ 3*i, 3*i+1, 3*i+2 }};
+        mdl->tris[i] = t;
+    }
+    mdl->num_meshes = 1;
+    mdl->meshes = meshes;
+    memset( meshes, 0, sizeof(IqmMesh) );
+    meshes[0].num_triangles = num_tris;
+}
+
+// nearest hit in double precision, away from the edges and not grazing in 'clear',
+// up to 10*EDGE outside the edges in 'any'
+static void brute_raycast( GModel *mdl, const GVec *o, const GVec *d, double *clear, double *any ) {
+    int i;
+    *clear = *any = 1e30;
+    for( i = 0; i < mdl->num_tris; i++ ) {
+        const GVec *a = &mdl->verts[mdl->tris[i].vertex[0]].loc, *b = &mdl->verts[mdl->tris[i].vertex[1]].loc,
+                   *c = &mdl->verts[mdl->tris[i].vertex[2]].loc;
+        double e1[3] = { b->x - a->x, b->y - a->y, b->z - a->z }, e2[3] = { c->x - a->x, c->y - a->y, c->z - a->z };
+        double p[3] = { d->y*e2[2] - d->z*e2[1], d->z*e2[0] - d->x*e2[2], d->x*e2[1] - d->y*e2[0] };
+        double det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+        if( det == 0 ) continue;
+        double s[3] = { o->x - a->x, o->y - a->y, o->z - a->z };
+        double q[3] = { s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0] };
+        double u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) / det, v = (d->x*q[0] + d->y*q[1] + d->z*q[2]) / det;
+        double t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) / det;
+        if( t < 0 ) continue;
+        if( u >= -10*EDGE && v >= -10*EDGE && u + v <= 1 + 10*EDGE && t < *any ) *any = t;
+        double area = sqrt( (p[0]*p[0] + p[1]*p[1] + p[2]*p[2]) * (e1[0]*e1[0] + e1[1]*e1[1] + e1[2]*e1[2]) );
+        if( fabs( det ) > 1e-3 * area && u > EDGE && v > EDGE && u + v < 1 - EDGE && t < *clear ) *clear = t;
+    }
+}
+
+static int check( const char *name, GModel *mdl ) {
+    int i, compared = 0, failed = 0;
+    for( i = 0; i < NUM_RAYS; i++ ) {
+        GVec o = { frand(-3, 3), frand(-3, 3), frand(-3, 3) }, d = { frand(-1, 1), frand(-1, 1), frand(-1, 1) };
+        if( i & 1 ) { // through a vertex along the other two axes, the origin lies on box planes
+            int axis = rand() % 3;
+            o = mdl->verts[rand() % mdl->num_verts].loc;
+            (&d.x)[axis] = 0;
+            o.x -= 3*d.x; o.y -= 3*d.y; o.z -= 3*d.z;
+        }
+        double clear, any;
+        brute_raycast( mdl, &o, &d, &clear, &any );
+        int expected = any < 1e30;
+        if( expected && clear > any + TOLERANCE * (1 + any) ) continue; // the nearest hit is on an edge
+        GRayHit hit;
+        int found = g_model_raycast( mdl, &o, &d, FLT_MAX, &hit );
+        compared++;
+        if( found != expected || (found && (fabs( hit.t - clear ) > TOLERANCE * (1 + clear) ||
+            (unsigned int) hit.tri - mdl->meshes[hit.mesh].first_triangle >= mdl->meshes[hit.mesh].num_triangles)) ) {
+            if( !failed ) printf( "raycheck: %s ray %d, bvh %d t %g, every triangle %d t %g\n", name, i, found, found ? hit.t : 0, expected, clear );
+            failed++;
+        }
+    }
+    printf( "raycheck: %s, %d tris, %d nodes, %d rays compared, %d wrong\n", name, mdl->num_tris, mdl->num_bvh_nodes, compared, failed );
+    return failed;
+}
+
+// Rays at the inside of make_sphere() can't get through, even along the rings where they only
+// touch edges lying on box planes. The hit is between the inscribed and the unit sphere
+static int check_closed( GModel *mdl ) {
+    int i, failed = 0;
+    for( i = 0; i < NUM_RAYS; i++ ) {
+        GVec target = { frand(-0.5f, 0.5f), frand(-0.5f, 0.5f), frand(-0.5f, 0.5f) }, d = { frand(-1, 1), frand(-1, 1), frand(-1, 1) };
+        if( i & 1 ) { // in the plane of a vertex along one axis, along z that's a ring
+            int axis = rand() % 3;
+            float c;
+            do c = (&mdl->verts[rand() % mdl->num_verts].loc.x)[axis]; while( fabsf( c ) > 0.5f );
+            (&target.x)[axis] = c;
+            (&d.x)[axis] = 0;
+        }
+        float len = sqrtf( d.x*d.x + d.y*d.y + d.z*d.z );
+        if( len < 0.1f ) continue;
+        GVec o = { target.x - 3*d.x/len, target.y - 3*d.y/len, target.z - 3*d.z/len };
+        GRayHit hit;
+        int found = g_model_raycast( mdl, &o, &d, FLT_MAX, &hit );
+        GVec p = { o.x + hit.t*d.x, o.y + hit.t*d.y, o.z + hit.t*d.z };
+        float r = sqrtf( p.x*p.x + p.y*p.y + p.z*p.z );
+        if( !found || r < 0.99f || r > 1.0001f ) {
+            if( !failed ) printf( "raycheck: closed sphere ray %d, hit %d at radius %g\n", i, found, found ? r : 0 );
+            failed++;
+        }
+    }
+    printf( "raycheck: closed sphere, %d rays through it, %d got out\n", NUM_RAYS, failed );
+    return failed;
+}
+
+static void free_mesh( GModel *mdl ) {
+    g_free( mdl->verts );
+    g_free( mdl->tris );
+    g_free( mdl->bvh_nodes );
+    g_free( mdl->bvh_blocks );
+}
+
+int main( int argc, char **argv ) {
+    GModel mdl;
+    IqmMesh meshes[2];
+    int failed = 0;
+
+    srand( argc > 1 ? atoi( argv[1] ) : 1 );
+    memset( &mdl, 0, sizeof(mdl) );
+    make_sphere( &mdl, meshes, 40, 80 );
+    build_bvh( &mdl, "sphere" );
+    failed += check( "sphere", &mdl );
+    failed += check_closed( &mdl );
+    free_mesh( &mdl );
+    memset( &mdl, 0, sizeof(mdl) );
+    make_soup( &mdl, meshes, 2000 );
+    build_bvh( &mdl, "soup" );
+    failed += check( "soup", &mdl );
+    free_mesh( &mdl );
+
+    if( failed ) {
+        printf( "raycheck: FAILED\n" );
+        return 1;
+    }
+    return 0;
+}
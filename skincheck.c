@@ -0,0 +1,126 @@
+// Self check for the SIMD skinning path, run with 'make check'.
+// Skins a synthetic model with skin_verts() and compares every vertex against
+// the scalar skin_vert(), then moves joints and compares G_SKIN_INCREMENTAL with
+// a full skin. Exits with 1 when a vertex is further off than TOLERANCE
+#include "model.c"
+
+#define NUM_VERTS 4099  // not a multiple of 4, so the scalar tail runs too
+#define NUM_JOINTS 64
+#define TOLERANCE 1e-4f
+
+static float frand( float lo, float hi ) {
+    return lo + (hi - lo) * (rand() / (float) RAND_MAX);
+}
+
+static void random_joint( GDualQuat *dq ) {
+    GVec axis = { frand(-1, 1), frand(-1, 1), frand(-1, 1) }, t = { frand(-2, 2), frand(-2, 2), frand(-2, 2) };
+    GQuat q;
+    if( axis.x == 0 && axis.y == 0 && axis.z == 0 ) axis.z = 1;
+    g_quat_from_axis_angle( &q, &axis, frand(-3.14f, 3.14f) );
+    g_quat_normalize( &q );
+    if( rand() & 1 ) { // same rotation, other hemisphere: the blend has to flip its weight
+        q.x = -q.x; q.y = -q.y; q.z = -q.z; q.w = -q.w;
+    }
+    g_dual_quat_from_quat_vec( dq, &q, &t );
+}
+
+static void random_vert( IqmVertex *v ) {
+    int j, n = 1 + rand() % 4, left = 255;
+    memset( v, 0, sizeof(IqmVertex) );
+    v->loc.x = frand(-2, 2); v->loc.y = frand(-2, 2); v->loc.z = frand(-2, 2);
+    for( j = 0; j < n; j++ ) {
+        int w = j == n-1 ? left : rand() % (left + 1);
+        v->blendindex[j] = rand() % NUM_JOINTS;
+        v->blendweight[j] = w;
+        left -= w;
+    }
+    // the scalar loop stops at the first empty slot, the blocks must ignore whatever follows it
+    if( n < 4 && (rand() & 3) == 0 ) {
+        v->blendindex[3] = rand() % NUM_JOINTS;
+        v->blendweight[3] = 1 + rand() % 255;
+    }
+}
+
+static float max_error( const GVec *a, const GVec *b, int n, int *worst ) {
+    float maxerr = 0;
+    int i;
+    for( i = 0; i < n; i++ ) {
+        float err = fmaxf( fabsf(a[i].x - b[i].x), fmaxf( fabsf(a[i].y - b[i].y), fabsf(a[i].z - b[i].z) ) );
+        if( !(err <= maxerr) ) { // NaN counts as the worst
+            maxerr = err;
+            *worst = i;
+        }
+    }
+    return maxerr;
+}
+
+// 1 joint moved, then 2, 4... up to all of them, so both the dirty block and the full
+// reskin paths of skin_incremental() run
+static float check_incremental( GModel *mdl, GDualQuat *palette, GVec *full ) {
+    GModelInstance inst;
+    SkinJob job = { mdl, palette, full };
+    float maxerr = 0;
+    int moved, i, worst = 0;
+
+    memset( &inst, 0, sizeof(inst) );
+    inst.mdl = mdl;
+    inst.outframe = palette;
+    mdl->num_joints = NUM_JOINTS;
+    build_influences( mdl );
+    skin_incremental( &inst );
+    for( moved = 1; moved <= NUM_JOINTS; moved *= 2 ) {
+        for( i = 0; i < moved; i++ ) random_joint( &palette[rand() % NUM_JOINTS] );
+        int blocks = skin_incremental( &inst );
+        skin_verts( &job, 0, NUM_VERTS );
+        float err = max_error( inst.out_verts, full, NUM_VERTS, &worst );
+        printf( "skincheck: incremental, %d joints moved, %d blocks skinned, max error %g\n", moved, blocks, err );
+        maxerr = fmaxf( maxerr, err );
+    }
+
+    g_free( inst.out_verts );
+    g_free( inst.skinned_frame );
+    g_free( mdl->joint_blocks );
+    g_free( mdl->joint_block_ofs );
+    g_free( mdl->dirty_blocks );
+    g_free( mdl->block_dirty );
+    return maxerr;
+}
+
+int main( int argc, char **argv ) {
+    GModel mdl;
+    GDualQuat palette[NUM_JOINTS];
+    GVec *simd = g_new( GVec, NUM_VERTS ), *scalar = g_new( GVec, NUM_VERTS );
+    SkinJob job = { &mdl, palette, simd };
+    int i, worst = 0;
+
+    srand( argc > 1 ? atoi( argv[1] ) : 1 );
+    memset( &mdl, 0, sizeof(mdl) );
+    mdl.num_verts = NUM_VERTS;
+    mdl.verts = g_new( IqmVertex, NUM_VERTS );
+    for( i = 0; i < NUM_VERTS; i++ ) random_vert( &mdl.verts[i] );
+    for( i = 0; i < NUM_JOINTS; i++ ) random_joint( &palette[i] );
+
+#ifdef G_SSE
+    build_skin_blocks( &mdl );
+#else
+    printf( "skincheck: built without SSE, comparing the scalar path with itself\n" );
+#endif
+    skin_verts( &job, 0, NUM_VERTS );
+    job.out = scalar;
+    for( i = 0; i < NUM_VERTS; i++ ) skin_vert( &job, i );
+
+    float maxerr = max_error( simd, scalar, NUM_VERTS, &worst );
+    printf( "skincheck: %d verts, %d joints, max error %g at vert %d (tolerance %g)\n", NUM_VERTS, NUM_JOINTS, maxerr, worst, TOLERANCE );
+    maxerr = fmaxf( maxerr, check_incremental( &mdl, palette, scalar ) );
+#ifdef G_SSE
+    _mm_free( mdl.skin_blocks );
+#endif
+    g_free( mdl.verts );
+    g_free( simd );
+    g_free( scalar );
+    if( !(maxerr <= TOLERANCE) ) {
+        printf( "skincheck: FAILED\n" );
+        return 1;
+    }
+    return 0;
+}
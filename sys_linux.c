@@ -5,6 +5,11 @@
 #include <sys/time.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define G_GL_EXT_IMPLEMENT
 #include "myr.h"
@@ -13,6 +18,13 @@
 
 GConfig conf = { NULL, 640, 480, 0, 15, NULL };
 
+double g_time( void ) {
+    struct timeval tp;
+    gettimeofday( &tp, NULL );
+    return tp.tv_sec + tp.tv_usec / 1000000.0;
+}
+
+#ifndef G_NO_MAIN // for programs that only link the platform layer, like skincheck
 static unsigned int get_milliseconds() {
     struct timeval tp;
     gettimeofday(&tp, NULL);
@@ -243,6 +255,7 @@ int main(int argc, char** argv) {
     g_cleanup( conf.data );
     return 0;
 }
+#endif
 
 #define ERR_STR_LEN 1024
 
@@ -285,3 +298,192 @@ void g_fatal_error(const char* str, ...) {
 //     fputws(msg, stderr);
 //     exit(1);
 // }
+
+//
+// File mapping
+//
+void* g_file_map( const char *filename, size_t *size ) {
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 ) return NULL;
+
+    struct stat st;
+    void *data = NULL;
+    if( !fstat( fd, &st ) && st.st_size > 0 ) {
+        data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( data == MAP_FAILED ) data = NULL;
+        else *size = st.st_size;
+    }
+    close( fd ); // the mapping keeps its own reference
+    return data;
+}
+
+void g_file_unmap( void *data, size_t size ) {
+    if( data ) munmap( data, size );
+}
+
+int g_file_stamp( const char *filename, unsigned long long *size, unsigned long long *mtime ) {
+    struct stat st;
+    if( stat( filename, &st ) ) return 0;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return 1;
+}
+
+//
+// Worker pool
+//
+struct _GJob {
+    GTaskFunc fn;
+    void *data;
+    int finished;
+    GJob *next;
+};
+
+struct _GWorkers {
+    pthread_t *threads;
+    int num_threads, quit;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+
+    // the batch being processed
+    GTaskFunc fn;
+    void *data;
+    int count, chunk, next, remaining;
+
+    GJob *jobs, **jobs_end; // background jobs waiting for a worker
+};
+
+// claims and runs chunks of the current batch, called with the lock held
+static void workers_run_chunks( GWorkers* w ) {
+    while( w->next < w->count ) {
+        int first = w->next;
+        int last = first + w->chunk < w->count ? first + w->chunk : w->count;
+        w->next = last;
+
+        pthread_mutex_unlock( &w->lock );
+        w->fn( w->data, first, last );
+        pthread_mutex_lock( &w->lock );
+
+        w->remaining -= last - first;
+        if( !w->remaining ) pthread_cond_broadcast( &w->done );
+    }
+}
+
+// runs the oldest background job, called with the lock held
+static void workers_run_job( GWorkers* w ) {
+    GJob* job = w->jobs;
+    w->jobs = job->next;
+    if( !w->jobs ) w->jobs_end = &w->jobs;
+
+    pthread_mutex_unlock( &w->lock );
+    job->fn( job->data, 0, 1 );
+    pthread_mutex_lock( &w->lock );
+
+    job->finished = 1;
+    pthread_cond_broadcast( &w->done );
+}
+
+// batches come first, they block the thread that started them
+static void* workers_main( void* arg ) {
+    GWorkers* w = (GWorkers*) arg;
+    pthread_mutex_lock( &w->lock );
+    for( ;; ) {
+        if( w->next < w->count ) workers_run_chunks( w );
+        else if( w->jobs ) workers_run_job( w );
+        else if( w->quit ) break;
+        else pthread_cond_wait( &w->wake, &w->lock );
+    }
+    pthread_mutex_unlock( &w->lock );
+    return NULL;
+}
+
+int g_cpu_count( void ) {
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    return n > 0 ? (int) n : 1;
+}
+
+GWorkers* g_workers_new( int num_threads ) {
+    if( num_threads <= 0 ) num_threads = g_cpu_count() - 1;
+
+    GWorkers* w = g_new0( GWorkers, 1 );
+    w->threads = g_new0( pthread_t, num_threads > 0 ? num_threads : 1 );
+    pthread_mutex_init( &w->lock, NULL );
+    pthread_cond_init( &w->wake, NULL );
+    pthread_cond_init( &w->done, NULL );
+    w->jobs_end = &w->jobs;
+
+    int i;
+    for( i = 0; i < num_threads; i++ ) {
+        if( pthread_create( &w->threads[i], NULL, workers_main, w ) ) break;
+        w->num_threads++;
+    }
+    return w;
+}
+
+void g_workers_run( GWorkers* w, GTaskFunc fn, void *data, int count, int chunk ) {
+    if( count <= 0 ) return;
+    if( !w || !w->num_threads || count <= chunk ) {
+        fn( data, 0, count );
+        return;
+    }
+
+    pthread_mutex_lock( &w->lock );
+    w->fn = fn;
+    w->data = data;
+    w->chunk = chunk > 0 ? chunk : 1;
+    w->next = 0;
+    w->count = w->remaining = count;
+    pthread_cond_broadcast( &w->wake );
+
+    workers_run_chunks( w );
+    while( w->remaining ) pthread_cond_wait( &w->done, &w->lock );
+    w->count = w->next = 0;
+    pthread_mutex_unlock( &w->lock );
+}
+
+GJob* g_workers_submit( GWorkers* w, GTaskFunc fn, void *data ) {
+    GJob* job = g_new0( GJob, 1 );
+    job->fn = fn;
+    job->data = data;
+    if( !w || !w->num_threads ) {
+        fn( data, 0, 1 );
+        job->finished = 1;
+        return job;
+    }
+
+    pthread_mutex_lock( &w->lock );
+    *w->jobs_end = job;
+    w->jobs_end = &job->next;
+    pthread_cond_signal( &w->wake );
+    pthread_mutex_unlock( &w->lock );
+    return job;
+}
+
+int g_workers_poll( GWorkers* w, GJob* job, int wait ) {
+    int finished = 1; // submitted without threads
+    if( w && w->num_threads ) {
+        pthread_mutex_lock( &w->lock );
+        while( wait && !job->finished ) pthread_cond_wait( &w->done, &w->lock );
+        finished = job->finished;
+        pthread_mutex_unlock( &w->lock );
+    }
+    if( finished ) g_free( job );
+    return finished;
+}
+
+void g_workers_destroy( GWorkers* w ) {
+    if( !w ) return;
+    pthread_mutex_lock( &w->lock );
+    w->quit = 1;
+    pthread_cond_broadcast( &w->wake );
+    pthread_mutex_unlock( &w->lock );
+
+    int i;
+    for( i = 0; i < w->num_threads; i++ ) pthread_join( w->threads[i], NULL );
+
+    pthread_cond_destroy( &w->done );
+    pthread_cond_destroy( &w->wake );
+    pthread_mutex_destroy( &w->lock );
+    g_free( w->threads );
+    g_free( w );
+}
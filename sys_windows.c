@@ -10,6 +10,12 @@
 
 GConfig conf = { NULL, 640, 480, 0, 15, NULL };
 
+double g_time( void ) {
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency( &freq );
+    QueryPerformanceCounter( &now );
+    return (double) now.QuadPart / freq.QuadPart;
+}
 
 LRESULT WINAPI MsgProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam);
 
@@ -265,3 +271,215 @@ void g_fatal_error( const char* str, ... ) {
 #endif
     exit(1);
 }
+
+//
+// File mapping
+//
+void* g_file_map( const char *filename, size_t *size ) {
+    HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if( file == INVALID_HANDLE_VALUE ) return NULL;
+
+    void *data = NULL;
+    DWORD high, low = GetFileSize( file, &high );
+    if( low != INVALID_FILE_SIZE && (low || high) ) {
+        HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+        if( mapping ) {
+            data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+            if( data ) *size = (size_t) (((unsigned long long) high << 32) | low);
+            CloseHandle( mapping ); // the view keeps its own reference
+        }
+    }
+    CloseHandle( file );
+    return data;
+}
+
+void g_file_unmap( void *data, size_t size ) {
+    if( data ) UnmapViewOfFile( data );
+}
+
+int g_file_stamp( const char *filename, unsigned long long *size, unsigned long long *mtime ) {
+    WIN32_FILE_ATTRIBUTE_DATA fa;
+    if( !GetFileAttributesExA( filename, GetFileExInfoStandard, &fa ) ) return 0;
+    *size = ((unsigned long long) fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+    *mtime = ((unsigned long long) fa.ftLastWriteTime.dwHighDateTime << 32) | fa.ftLastWriteTime.dwLowDateTime;
+    return 1;
+}
+
+//
+// Worker pool
+//
+struct _GJob {
+    GTaskFunc fn;
+    void *data;
+    int finished;
+    GJob *next;
+};
+
+struct _GWorkers {
+    HANDLE *threads;
+    int num_threads, quit;
+    CRITICAL_SECTION lock;
+    HANDLE wake, done; // semaphore and auto-reset event, no condition variables before Vista
+
+    // the batch being processed
+    GTaskFunc fn;
+    void *data;
+    int count, chunk, next, remaining;
+
+    GJob *jobs, **jobs_end; // background jobs waiting for a worker
+    HANDLE job_done;        // auto-reset event, set whenever one finishes
+};
+
+// claims and runs chunks of the current batch, called with the lock held
+static void workers_run_chunks( GWorkers* w ) {
+    while( w->next < w->count ) {
+        int first = w->next;
+        int last = first + w->chunk < w->count ? first + w->chunk : w->count;
+        w->next = last;
+
+        LeaveCriticalSection( &w->lock );
+        w->fn( w->data, first, last );
+        EnterCriticalSection( &w->lock );
+
+        w->remaining -= last - first;
+        if( !w->remaining ) SetEvent( w->done );
+    }
+}
+
+// runs the oldest background job, called with the lock held
+static void workers_run_job( GWorkers* w ) {
+    GJob* job = w->jobs;
+    w->jobs = job->next;
+    if( !w->jobs ) w->jobs_end = &w->jobs;
+
+    LeaveCriticalSection( &w->lock );
+    job->fn( job->data, 0, 1 );
+    EnterCriticalSection( &w->lock );
+
+    job->finished = 1;
+    SetEvent( w->job_done );
+}
+
+// every batch and every submitted job releases the semaphore, a worker runs one job per wake
+// so none are left waiting, except when quitting where the jobs left are all drained
+static DWORD WINAPI workers_main( LPVOID arg ) {
+    GWorkers* w = (GWorkers*) arg;
+    for( ;; ) {
+        WaitForSingleObject( w->wake, INFINITE );
+        EnterCriticalSection( &w->lock );
+        workers_run_chunks( w );
+        if( w->quit ) {
+            while( w->jobs ) workers_run_job( w );
+            LeaveCriticalSection( &w->lock );
+            break;
+        }
+        if( w->jobs ) workers_run_job( w );
+        LeaveCriticalSection( &w->lock );
+    }
+    return 0;
+}
+
+int g_cpu_count( void ) {
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    return info.dwNumberOfProcessors > 0 ? (int) info.dwNumberOfProcessors : 1;
+}
+
+GWorkers* g_workers_new( int num_threads ) {
+    if( num_threads <= 0 ) num_threads = g_cpu_count() - 1;
+
+    GWorkers* w = g_new0( GWorkers, 1 );
+    w->threads = g_new0( HANDLE, num_threads > 0 ? num_threads : 1 );
+    InitializeCriticalSection( &w->lock );
+    w->wake = CreateSemaphore( NULL, 0, 0x7fffffff, NULL );
+    w->done = CreateEvent( NULL, FALSE, FALSE, NULL );
+    w->job_done = CreateEvent( NULL, FALSE, FALSE, NULL );
+    w->jobs_end = &w->jobs;
+
+    int i;
+    for( i = 0; i < num_threads; i++ ) {
+        w->threads[i] = CreateThread( NULL, 0, workers_main, w, 0, NULL );
+        if( !w->threads[i] ) break;
+        w->num_threads++;
+    }
+    return w;
+}
+
+void g_workers_run( GWorkers* w, GTaskFunc fn, void *data, int count, int chunk ) {
+    if( count <= 0 ) return;
+    if( !w || !w->num_threads || count <= chunk ) {
+        fn( data, 0, count );
+        return;
+    }
+
+    EnterCriticalSection( &w->lock );
+    w->fn = fn;
+    w->data = data;
+    w->chunk = chunk > 0 ? chunk : 1;
+    w->next = 0;
+    w->count = w->remaining = count;
+    ResetEvent( w->done );
+    ReleaseSemaphore( w->wake, w->num_threads, NULL );
+
+    workers_run_chunks( w );
+    while( w->remaining ) {
+        LeaveCriticalSection( &w->lock );
+        WaitForSingleObject( w->done, INFINITE );
+        EnterCriticalSection( &w->lock );
+    }
+    w->count = w->next = 0;
+    LeaveCriticalSection( &w->lock );
+}
+
+GJob* g_workers_submit( GWorkers* w, GTaskFunc fn, void *data ) {
+    GJob* job = g_new0( GJob, 1 );
+    job->fn = fn;
+    job->data = data;
+    if( !w || !w->num_threads ) {
+        fn( data, 0, 1 );
+        job->finished = 1;
+        return job;
+    }
+
+    EnterCriticalSection( &w->lock );
+    *w->jobs_end = job;
+    w->jobs_end = &job->next;
+    LeaveCriticalSection( &w->lock );
+    ReleaseSemaphore( w->wake, 1, NULL );
+    return job;
+}
+
+int g_workers_poll( GWorkers* w, GJob* job, int wait ) {
+    int finished = 1; // submitted without threads
+    if( w && w->num_threads ) {
+        EnterCriticalSection( &w->lock );
+        while( wait && !job->finished ) {
+            LeaveCriticalSection( &w->lock );
+            WaitForSingleObject( w->job_done, INFINITE );
+            EnterCriticalSection( &w->lock );
+        }
+        finished = job->finished;
+        LeaveCriticalSection( &w->lock );
+    }
+    if( finished ) g_free( job );
+    return finished;
+}
+
+void g_workers_destroy( GWorkers* w ) {
+    if( !w ) return;
+    EnterCriticalSection( &w->lock );
+    w->quit = 1;
+    LeaveCriticalSection( &w->lock );
+    ReleaseSemaphore( w->wake, w->num_threads, NULL );
+
+    WaitForMultipleObjects( w->num_threads, w->threads, TRUE, INFINITE );
+
+    int i;
+    for( i = 0; i < w->num_threads; i++ ) CloseHandle( w->threads[i] );
+    CloseHandle( w->wake );
+    CloseHandle( w->done );
+    CloseHandle( w->job_done );
+    DeleteCriticalSection( &w->lock );
+    g_free( w->threads );
+    g_free( w );
+}